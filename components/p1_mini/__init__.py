@@ -2,21 +2,91 @@ import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import uart
 from esphome.components import binary_sensor
-from esphome.const import CONF_ID, CONF_TRIGGER_ID
+from esphome.components import sensor
+from esphome.const import (
+    CONF_FORMAT,
+    CONF_ID,
+    CONF_PATH,
+    CONF_PLATFORM,
+    CONF_PORT,
+    CONF_SENSOR,
+    CONF_SIZE,
+    CONF_TEXT_SENSOR,
+    CONF_TRIGGER_ID,
+    CONF_TYPE,
+    CONF_UPDATE_INTERVAL,
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+    UNIT_MILLISECOND,
+)
+from esphome.core import CORE
 from esphome import automation
+import esphome.final_validate as fv
 import re
+from collections import namedtuple
 
 DEPENDENCIES = ['uart']
+
+# Only what the configured options need, so that a plain config does not pull in the
+# networking components
+def AUTO_LOAD():
+    auto_load = ['sensor']
+    instances = (CORE.raw_config or {}).get('p1_mini') or []
+    for instance in instances if isinstance(instances, list) else [instances]:
+        if not isinstance(instance, dict):
+            continue
+        if CONF_TCP_SERVER in instance:
+            auto_load.append('socket')
+        if CONF_HISTORY in instance:
+            auto_load.append('web_server_base')
+    return sorted(set(auto_load))
+
 p1_mini_ns = cg.esphome_ns.namespace('p1_mini')
 P1Mini = p1_mini_ns.class_('P1Mini', cg.Component, uart.UARTDevice)
+P1MiniSensorSlot = p1_mini_ns.struct('P1MiniSensorSlot')
+P1MiniTextSensorTrieNode = p1_mini_ns.struct('P1MiniTextSensorTrieNode')
+P1MiniStagedText = p1_mini_ns.struct('P1MiniStagedText')
+P1MiniTimeSensor = p1_mini_ns.struct('P1MiniTimeSensor')
+P1MiniReceiveTask = p1_mini_ns.class_('P1MiniReceiveTask')
+P1MiniHistoryServer = p1_mini_ns.class_('P1MiniHistoryServer')
+P1MiniTcpServer = p1_mini_ns.class_('P1MiniTcpServer')
+P1MiniTcpClient = p1_mini_ns.struct('P1MiniTcpClient')
+P1MiniDerivedValue = p1_mini_ns.struct('P1MiniDerivedValue')
+P1MiniEngine = p1_mini_ns.class_('P1MiniEngine')
+# Referenced by id only, so their modules are not imported
+UDPComponent = cg.esphome_ns.namespace('udp').class_('UDPComponent')
+WebServerBase = cg.esphome_ns.namespace('web_server_base').class_('WebServerBase')
 MULTI_CONF = True
 
 CONF_P1_MINI_ID = "p1_mini_id"
 CONF_OBIS_CODE = "obis_code"
+CONF_DERIVED = "derived"
+CONF_SOURCES = "sources"
 CONF_IDENTIFIER = "identifier"
 CONF_MINIMUM_PERIOD = "minimum_period"
+CONF_TARGET_PERIOD = "target_period"
 CONF_BUFFER_SIZE = "buffer_size"
+CONF_BUFFER_LOCATION = "buffer_location"
 CONF_SECONDARY_RTS = "secondary_rts"
+CONF_PASSTHROUGH_UART_ID = "passthrough_uart_id"
+CONF_CRC_METHOD = "crc_method"
+CONF_DOUBLE_BUFFER = "double_buffer"
+CONF_STREAMING = "streaming"
+CONF_MAX_LINE_LENGTH = "max_line_length"
+CONF_RECEIVE_TASK = "receive_task"
+CONF_PROCESSING_BUDGET = "processing_budget"
+CONF_DIAGNOSTICS = "diagnostics"
+CONF_STATISTIC = "statistic"
+CONF_HISTORY = "history"
+CONF_WEB_SERVER_BASE_ID = "web_server_base_id"
+CONF_RAW_TELEGRAM = "raw_telegram"
+CONF_MQTT_TOPIC = "mqtt_topic"
+CONF_UDP_ID = "udp_id"
+CONF_TCP_SERVER = "tcp_server"
+CONF_MAX_CLIENTS = "max_clients"
+CONF_SHARE_WITH = "share_with"
+CONF_SHARE_BUFFER = "share_buffer"
 CONF_ON_READY_TO_RECEIVE = "on_ready_to_receive"
 CONF_ON_RECEIVING_UPDATE = "on_receiving_update"
 CONF_ON_UPDATE_RECEIVED = "on_update_received"
@@ -31,12 +101,134 @@ ReceivingUpdateTrigger = p1_mini_ns.class_("ReceivingUpdateTrigger", automation.
 UpdateReceivedTrigger = p1_mini_ns.class_("UpdateReceivedTrigger", automation.Trigger.template())
 UpdateProcessedTrigger = p1_mini_ns.class_("UpdateProcessedTrigger", automation.Trigger.template())
 CommunicationErrorTrigger = p1_mini_ns.class_("CommunicationErrorTrigger", automation.Trigger.template())
+TRIGGERS = [
+    (CONF_ON_READY_TO_RECEIVE, "ready_to_receive", ReadyToReceiveTrigger),
+    (CONF_ON_RECEIVING_UPDATE, "receiving_update", ReceivingUpdateTrigger),
+    (CONF_ON_UPDATE_RECEIVED, "update_received", UpdateReceivedTrigger),
+    (CONF_ON_UPDATE_PROCESSED, "update_processed", UpdateProcessedTrigger),
+    (CONF_ON_COMMUNICATION_ERROR, "communication_error", CommunicationErrorTrigger),
+]
+
+CRC_METHODS = ["table", "bitwise"]
+DerivedOperations = p1_mini_ns.enum("derived_operations", is_class=True)
+DERIVED_OPERATIONS = {
+    "sum": DerivedOperations.SUM,
+    "difference": DerivedOperations.DIFFERENCE,
+    "integral": DerivedOperations.INTEGRAL,
+}
+BufferLocations = p1_mini_ns.enum("buffer_locations", is_class=True)
+BUFFER_LOCATIONS = {
+    "internal": BufferLocations.INTERNAL,
+    "psram": BufferLocations.PSRAM,
+    "static": BufferLocations.STATIC,
+}
+FORMATS = ["ascii", "binary", "auto"]
+
+# Diagnostics
+TimeStages = p1_mini_ns.enum("time_stages", is_class=True)
+TIME_STAGES = {
+    "identifying_time": TimeStages.IDENTIFYING,
+    "message_time": TimeStages.MESSAGE,
+    "processing_time": TimeStages.PROCESSING,
+    "publishing_time": TimeStages.PUBLISHING,
+    "total_time": TimeStages.TOTAL,
+}
+# The number of loop() calls spent parsing each message
+CONF_PROCESSING_SLICES = "processing_slices"
+TimeStatistics = p1_mini_ns.enum("time_statistics", is_class=True)
+TIME_STATISTICS = {
+    "min": TimeStatistics.MIN,
+    "avg": TimeStatistics.AVG,
+    "max": TimeStatistics.MAX,
+    "p95": TimeStatistics.P95,
+}
+ErrorCounters = p1_mini_ns.enum("error_counters", is_class=True)
+ERROR_COUNTERS = {
+    "crc_errors": ErrorCounters.CRC_ERRORS,
+    "buffer_overruns": ErrorCounters.BUFFER_OVERRUNS,
+    "timeouts": ErrorCounters.TIMEOUTS,
+    "unknown_frames": ErrorCounters.UNKNOWN_FRAMES,
+}
+
+TIME_SENSOR_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_MILLISECOND,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+).extend({
+    cv.Optional(CONF_STATISTIC, default="avg"): cv.enum(TIME_STATISTICS, lower=True),
+})
+
+SLICES_SENSOR_SCHEMA = sensor.sensor_schema(
+    accuracy_decimals=1,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+).extend({
+    cv.Optional(CONF_STATISTIC, default="avg"): cv.enum(TIME_STATISTICS, lower=True),
+})
+
+ERROR_SENSOR_SCHEMA = sensor.sensor_schema(
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_TOTAL_INCREASING,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+DIAGNOSTICS_SCHEMA = cv.Schema({
+    cv.Optional(CONF_UPDATE_INTERVAL, default="60s"): cv.positive_time_period_milliseconds,
+    **{cv.Optional(key): TIME_SENSOR_SCHEMA for key in TIME_STAGES},
+    cv.Optional(CONF_PROCESSING_SLICES): SLICES_SENSOR_SCHEMA,
+    **{cv.Optional(key): ERROR_SENSOR_SCHEMA for key in ERROR_COUNTERS},
+})
+
+def history_path(value):
+    value = cv.string(value)
+    if not value.startswith("/"):
+        raise cv.Invalid("The path must start with '/'")
+    return value
+
+# The history of the sensor values, served over HTTP by the web server
+HISTORY_SCHEMA = cv.Schema({
+    cv.GenerateID(CONF_WEB_SERVER_BASE_ID): cv.use_id(WebServerBase),
+    cv.Optional(CONF_SIZE, default=4096): cv.int_range(min=256, max=65536),
+    cv.Optional(CONF_PATH): history_path,
+})
+
+# Every verified message is sent on as it was received
+RAW_TELEGRAM_SCHEMA = cv.All(cv.Schema({
+    cv.Optional(CONF_MQTT_TOPIC): cv.All(cv.requires_component("mqtt"), cv.publish_topic),
+    cv.Optional(CONF_UDP_ID): cv.use_id(UDPComponent),
+}), cv.has_at_least_one_key(CONF_MQTT_TOPIC, CONF_UDP_ID))
+
+# Every verified message is served as it was received to the clients of a TCP port
+TCP_SERVER_SCHEMA = cv.Schema({
+    cv.Required(CONF_PORT): cv.port,
+    cv.Optional(CONF_MAX_CLIENTS, default=2): cv.int_range(min=1, max=8),
+})
 
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(): cv.declare_id(P1Mini),
     cv.Optional(CONF_SECONDARY_RTS): cv.use_id(binary_sensor.BinarySensor),
+    cv.Optional(CONF_PASSTHROUGH_UART_ID): cv.use_id(uart.UARTComponent),
     cv.Optional(CONF_MINIMUM_PERIOD, default="0s"): cv.time_period,
+    cv.Optional(CONF_TARGET_PERIOD): cv.positive_time_period_milliseconds,
     cv.Optional(CONF_BUFFER_SIZE, default=3072): cv.int_range(min=512, max=32768),
+    cv.Optional(CONF_BUFFER_LOCATION, default="internal"): cv.enum(BUFFER_LOCATIONS, lower=True),
+    cv.Optional(CONF_CRC_METHOD, default="table"): cv.one_of(*CRC_METHODS, lower=True),
+    cv.Optional(CONF_FORMAT, default="auto"): cv.one_of(*FORMATS, lower=True),
+    cv.Optional(CONF_DOUBLE_BUFFER, default=False): cv.boolean,
+    cv.Optional(CONF_STREAMING, default=False): cv.boolean,
+    cv.Optional(CONF_MAX_LINE_LENGTH, default=128): cv.int_range(min=16, max=32768),
+    cv.Optional(CONF_RECEIVE_TASK, default=False): cv.boolean,
+    cv.Optional(CONF_PROCESSING_BUDGET, default="10ms"): cv.All(
+        cv.positive_time_period_microseconds,
+        cv.Range(min=cv.TimePeriod(microseconds=500), max=cv.TimePeriod(milliseconds=100)),
+    ),
+    cv.Optional(CONF_SHARE_WITH): cv.use_id(P1Mini),
+    cv.Optional(CONF_SHARE_BUFFER, default=False): cv.boolean,
+    cv.Optional(CONF_DIAGNOSTICS): DIAGNOSTICS_SCHEMA,
+    cv.Optional(CONF_HISTORY): HISTORY_SCHEMA,
+    cv.Optional(CONF_RAW_TELEGRAM): RAW_TELEGRAM_SCHEMA,
+    cv.Optional(CONF_TCP_SERVER): TCP_SERVER_SCHEMA,
     cv.Optional(CONF_ON_READY_TO_RECEIVE): automation.validate_automation(
         {
             cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(ReadyToReceiveTrigger),
@@ -64,58 +256,359 @@ CONFIG_SCHEMA = cv.Schema({
     )
 }).extend(cv.COMPONENT_SCHEMA).extend(uart.UART_DEVICE_SCHEMA)
 
+def validate_streaming(config):
+    # When streaming, the values are staged while the message is received, which would
+    # overwrite those of the previous message while they are published
+    if config[CONF_STREAMING] and config[CONF_DOUBLE_BUFFER]:
+        raise cv.Invalid(f"'{CONF_STREAMING}' and '{CONF_DOUBLE_BUFFER}' can not be used together")
+    # The lines are dropped from the buffer as soon as they are parsed
+    for key in (CONF_RAW_TELEGRAM, CONF_TCP_SERVER):
+        if config[CONF_STREAMING] and key in config:
+            raise cv.Invalid(f"'{CONF_STREAMING}' and '{key}' can not be used together")
+    return config
+
+def validate_buffer_location(config):
+    if config[CONF_BUFFER_LOCATION] == "psram" and not CORE.is_esp32:
+        raise cv.Invalid(f"'{CONF_BUFFER_LOCATION}: psram' is only supported on ESP32")
+    return config
+
+def validate_receive_task(config):
+    # The task reads directly from the ESP-IDF UART driver
+    if config[CONF_RECEIVE_TASK] and not CORE.using_esp_idf:
+        raise cv.Invalid(f"'{CONF_RECEIVE_TASK}' is only supported on ESP32 with the esp-idf framework")
+    return config
+
+def validate_share_buffer(config):
+    if config[CONF_SHARE_BUFFER]:
+        if CONF_SHARE_WITH not in config:
+            raise cv.Invalid(f"'{CONF_SHARE_BUFFER}' needs '{CONF_SHARE_WITH}'")
+        if config[CONF_DOUBLE_BUFFER]:
+            raise cv.Invalid(f"'{CONF_SHARE_BUFFER}' and '{CONF_DOUBLE_BUFFER}' can not be used together")
+        # Only the instance with the buffer may have a message in flight, which takes RTS
+        if config[CONF_MINIMUM_PERIOD].total_milliseconds == 0:
+            raise cv.Invalid(f"'{CONF_SHARE_BUFFER}' needs the RTS signal and a '{CONF_MINIMUM_PERIOD}' above 0s")
+    return config
+
+def validate_target_period(config):
+    # Without RTS the meter sends at its own pace, and a period above 0s only gives errors
+    if CONF_TARGET_PERIOD in config and config[CONF_MINIMUM_PERIOD].total_milliseconds == 0:
+        raise cv.Invalid(f"'{CONF_TARGET_PERIOD}' needs the RTS signal and a '{CONF_MINIMUM_PERIOD}' above 0s")
+    return config
+
+CONFIG_SCHEMA = cv.All(CONFIG_SCHEMA, validate_streaming, validate_buffer_location, validate_receive_task, validate_share_buffer, validate_target_period)
+
+def instance_config(p1_mini_id, full_config=None):
+    instances = (full_config or CORE.config).get("p1_mini", [])
+    return next((conf for conf in instances if conf[CONF_ID].id == p1_mini_id.id), None)
+
+# The instances that receive into the buffer of the instance with p1_mini_id, including that
+# instance itself. Empty if no other instance shares its buffer.
+def shared_buffer_users(p1_mini_id):
+    users = [
+        conf for conf in CORE.config.get("p1_mini", [])
+        if conf[CONF_SHARE_BUFFER] and conf[CONF_SHARE_WITH].id == p1_mini_id.id
+    ]
+    if not users:
+        return []
+    return [instance_config(p1_mini_id)] + users
+
+# The history stream has a one byte count of the values
+MAX_HISTORY_VALUES = 255
+
+def final_validate(config):
+    if CONF_HISTORY in config:
+        num_values = len(sensor_table(config[CONF_ID], fv.full_config.get()))
+        if num_values > MAX_HISTORY_VALUES:
+            raise cv.Invalid(f"The history can hold at most {MAX_HISTORY_VALUES} values, and there are {num_values} sensors (including the sources of derived sensors)", path=[CONF_HISTORY])
+    if CONF_SHARE_WITH not in config:
+        return config
+    path = [CONF_SHARE_WITH]
+    if config[CONF_SHARE_WITH].id == config[CONF_ID].id:
+        raise cv.Invalid("An instance can not share with itself", path=path)
+    target = instance_config(config[CONF_SHARE_WITH], fv.full_config.get())
+    if CONF_SHARE_WITH in target:
+        raise cv.Invalid(f"'{target[CONF_ID].id}' shares with another instance itself", path=path)
+    if config[CONF_SHARE_BUFFER]:
+        # The shared buffer is always static
+        if target[CONF_DOUBLE_BUFFER] or target[CONF_BUFFER_LOCATION] == "psram":
+            raise cv.Invalid(f"The buffer of '{target[CONF_ID].id}' can not be shared with '{CONF_DOUBLE_BUFFER}' or '{CONF_BUFFER_LOCATION}: psram'", path=path)
+        if target[CONF_MINIMUM_PERIOD].total_milliseconds == 0:
+            raise cv.Invalid(f"The buffer of '{target[CONF_ID].id}' can only be shared if it uses the RTS signal", path=path)
+    return config
+
+FINAL_VALIDATE_SCHEMA = final_validate
+
 async def to_code(config):
+    # The instances that share with another one use its engine and, with share_buffer, its
+    # buffer, which is then as large as the largest buffer_size of those using it
+    engine_owner = config.get(CONF_SHARE_WITH, config[CONF_ID])
+    buffer_users = shared_buffer_users(engine_owner)
+    shared_buffer = any(conf[CONF_ID].id == config[CONF_ID].id for conf in buffer_users)
+    buffer_size = config[CONF_BUFFER_SIZE]
+    buffer_location = config[CONF_BUFFER_LOCATION]
+    if shared_buffer:
+        buffer_size = max(conf[CONF_BUFFER_SIZE] for conf in buffer_users)
+        buffer_location = "static"
+
     var = cg.new_Pvariable(
         config[CONF_ID],
         config[CONF_MINIMUM_PERIOD].total_milliseconds,
-        config[CONF_BUFFER_SIZE],
+        buffer_size,
+        BUFFER_LOCATIONS[buffer_location],
         )
+    # The storage for the sensors and triggers is sized here, so that the component
+    # allocates nothing for them. It is set up before anything below can wait for another
+    # component, as the sensor platforms may register their sensors at that point.
+    emit_storage(var, config)
+
     await cg.register_component(var, config)
     await uart.register_uart_device(var, config)
 
-    for conf in config.get(CONF_ON_READY_TO_RECEIVE, []):
-        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID])
-        cg.add(var.register_ready_to_receive_trigger(trigger))
-        await automation.build_automation(trigger, [], conf)
+    if CONF_SHARE_WITH not in config:
+        cg.add_global(cg.RawExpression(f"static {P1MiniEngine} {config[CONF_ID].id}_engine"))
+    cg.add(var.set_engine(cg.RawExpression(f"&{engine_owner.id}_engine"), shared_buffer))
+
+    if buffer_location == "static":
+        # Room for a terminator after a full buffer
+        buffer_id = f"{engine_owner.id if shared_buffer else config[CONF_ID].id}_buffer"
+        if not shared_buffer or CONF_SHARE_WITH not in config:
+            cg.add_global(cg.RawExpression(f"static char {buffer_id}[{buffer_size + 1}]"))
+        next_buffer = cg.nullptr
+        if config[CONF_DOUBLE_BUFFER]:
+            next_buffer = cg.RawExpression(f"{config[CONF_ID].id}_next_buffer")
+            cg.add_global(cg.RawExpression(f"static char {next_buffer}[{config[CONF_BUFFER_SIZE] + 1}]"))
+        cg.add(var.set_static_buffers(cg.RawExpression(buffer_id), next_buffer))
+
+    if config[CONF_DOUBLE_BUFFER]:
+        cg.add(var.enable_double_buffering())
 
-    for conf in config.get(CONF_ON_RECEIVING_UPDATE, []):
-        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID])
-        cg.add(var.register_receiving_update_trigger(trigger))
-        await automation.build_automation(trigger, [], conf)
+    if config[CONF_STREAMING]:
+        cg.add(var.enable_streaming())
 
-    for conf in config.get(CONF_ON_UPDATE_RECEIVED, []):
-        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID])
-        cg.add(var.register_update_received_trigger(trigger))
-        await automation.build_automation(trigger, [], conf)
+    if config[CONF_RECEIVE_TASK]:
+        cg.add_define("USE_P1_MINI_RECEIVE_TASK")
+        receive_task_id = f"{config[CONF_ID].id}_receive_task"
+        cg.add_global(cg.RawExpression(f"static {P1MiniReceiveTask} {receive_task_id}"))
+        cg.add(var.set_receive_task(cg.RawExpression(f"&{receive_task_id}")))
 
-    for conf in config.get(CONF_ON_UPDATE_PROCESSED, []):
-        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID])
-        cg.add(var.register_update_processed_trigger(trigger))
-        await automation.build_automation(trigger, [], conf)
+    # The lookup tables are shared by all instances, so they are used if any instance asks for them
+    if config[CONF_CRC_METHOD] == "table":
+        cg.add_define("USE_P1_MINI_CRC_TABLE")
 
-    for conf in config.get(CONF_ON_COMMUNICATION_ERROR, []):
-        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID])
-        cg.add(var.register_communication_error_trigger(trigger))
-        await automation.build_automation(trigger, [], conf)
+    # Likewise, the code for a format is included if any instance may receive it
+    if config[CONF_FORMAT] in ("ascii", "auto"):
+        cg.add_define("USE_P1_MINI_ASCII")
+    if config[CONF_FORMAT] in ("binary", "auto"):
+        cg.add_define("USE_P1_MINI_BINARY")
+
+    for key, name, _ in TRIGGERS:
+        for conf in config.get(key, []):
+            trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID])
+            cg.add(getattr(var, f"register_{name}_trigger")(trigger))
+            await automation.build_automation(trigger, [], conf)
+
+    if CONF_TARGET_PERIOD in config:
+        cg.add(var.set_target_period(config[CONF_TARGET_PERIOD]))
+    cg.add(var.set_processing_budget(config[CONF_PROCESSING_BUDGET]))
 
     if CONF_SECONDARY_RTS in config:
         sens = await cg.get_variable(config[CONF_SECONDARY_RTS])
         cg.add(var.set_secondary_rts(sens))
 
+    if CONF_PASSTHROUGH_UART_ID in config:
+        passthrough_uart = await cg.get_variable(config[CONF_PASSTHROUGH_UART_ID])
+        cg.add(var.set_passthrough_uart(passthrough_uart))
+
+    if CONF_HISTORY in config:
+        # The storage is set up by emit_storage()
+        cg.add_define("USE_P1_MINI_HISTORY")
+        server = await cg.get_variable(config[CONF_HISTORY][CONF_WEB_SERVER_BASE_ID])
+        cg.add(server.add_handler(cg.RawExpression(f"&{config[CONF_ID].id}_history_server")))
+
+    if CONF_RAW_TELEGRAM in config:
+        raw_telegram = config[CONF_RAW_TELEGRAM]
+        if CONF_MQTT_TOPIC in raw_telegram:
+            cg.add_define("USE_P1_MINI_RAW_MQTT")
+            cg.add(var.set_raw_mqtt_topic(raw_telegram[CONF_MQTT_TOPIC]))
+        if CONF_UDP_ID in raw_telegram:
+            cg.add_define("USE_P1_MINI_RAW_UDP")
+            udp_component = await cg.get_variable(raw_telegram[CONF_UDP_ID])
+            cg.add(var.set_raw_udp(udp_component))
+
+    if CONF_TCP_SERVER in config:
+        cg.add_define("USE_P1_MINI_TCP_SERVER")
+        tcp_server = config[CONF_TCP_SERVER]
+        prefix = config[CONF_ID].id
+        # One copy of the telegram, shared by all the clients
+        cg.add_global(cg.RawExpression(f"static {P1MiniTcpServer} {prefix}_tcp_server{{ {tcp_server[CONF_PORT]} }}"))
+        cg.add_global(cg.RawExpression(f"static {P1MiniTcpClient} {prefix}_tcp_clients[{tcp_server[CONF_MAX_CLIENTS]}]"))
+        cg.add_global(cg.RawExpression(f"static char {prefix}_tcp_buffer[{buffer_size}]"))
+        cg.add(cg.RawExpression(f"{prefix}_tcp_server.SetStorage({prefix}_tcp_clients, {tcp_server[CONF_MAX_CLIENTS]}, {prefix}_tcp_buffer, {buffer_size})"))
+        cg.add(var.set_tcp_server(cg.RawExpression(f"&{prefix}_tcp_server")))
+
+    if CONF_DIAGNOSTICS in config:
+        diagnostics = config[CONF_DIAGNOSTICS]
+        cg.add(var.set_diagnostics_interval(diagnostics[CONF_UPDATE_INTERVAL]))
+        for key, stage in TIME_STAGES.items():
+            if key in diagnostics:
+                sens = await sensor.new_sensor(diagnostics[key])
+                cg.add(var.add_time_sensor(stage, diagnostics[key][CONF_STATISTIC], sens))
+        if CONF_PROCESSING_SLICES in diagnostics:
+            sens = await sensor.new_sensor(diagnostics[CONF_PROCESSING_SLICES])
+            cg.add(var.add_time_sensor(TimeStages.PROCESSING_SLICES, diagnostics[CONF_PROCESSING_SLICES][CONF_STATISTIC], sens))
+        for key, counter in ERROR_COUNTERS.items():
+            if key in diagnostics:
+                sens = await sensor.new_sensor(diagnostics[key])
+                cg.add(var.set_error_sensor(counter, sens))
+
+def emit_storage(var, config):
+    prefix = config[CONF_ID].id
+
+    sensors = sensor_table(config[CONF_ID])
+    if sensors:
+        obis_codes_id = f"{prefix}_sensor_obis_codes"
+        sensors_id = f"{prefix}_sensors"
+        obis_codes = ", ".join(f"0x{slot.key:011x}ULL" for slot in sensors)
+        cg.add_global(cg.RawExpression(f"static constexpr uint64_t {obis_codes_id}[] = {{ {obis_codes} }}"))
+        cg.add_global(cg.RawExpression(f"static {P1MiniSensorSlot} {sensors_id}[{len(sensors)}]"))
+        cg.add(var.set_sensor_table(cg.RawExpression(obis_codes_id), cg.RawExpression(sensors_id), len(sensors)))
+
+    derived = [slot for slot in sensors if slot.derived is not None]
+    if derived:
+        sources_id = f"{prefix}_derived_sources"
+        derived_id = f"{prefix}_derived_values"
+        sources = []
+        derived_values = []
+        for slot in derived:
+            source_slots = [
+                index for index, source in enumerate(sensors)
+                if source.source_of is not None and source.source_of[0] == slot.sensor_id
+            ]
+            # In the order given in the yaml, which matters for the difference
+            source_slots.sort(key=lambda index: sensors[index].source_of[1])
+            operation = DERIVED_OPERATIONS[slot.derived[CONF_TYPE]]
+            derived_values.append(f"{{ {operation}, {sensors.index(slot)}, {sources_id} + {len(sources)}, {len(source_slots)} }}")
+            sources.extend(source_slots)
+        cg.add_global(cg.RawExpression(f"static constexpr int16_t {sources_id}[] = {{ {', '.join(map(str, sources))} }}"))
+        cg.add_global(cg.RawExpression(f"static {P1MiniDerivedValue} {derived_id}[] = {{ {', '.join(derived_values)} }}"))
+        cg.add(var.set_derived_values(cg.RawExpression(derived_id), len(derived)))
+
+    text_sensors = instance_text_sensors(config[CONF_ID])
+    if text_sensors:
+        # The trie has a root and at most one node per character of the identifiers
+        num_nodes = 1 + sum(len(conf[CONF_IDENTIFIER].encode()) for conf in text_sensors)
+        nodes_id = f"{prefix}_text_sensor_trie"
+        staged_texts_id = f"{prefix}_staged_texts"
+        cg.add_global(cg.RawExpression(f"static {P1MiniTextSensorTrieNode} {nodes_id}[{num_nodes}]"))
+        cg.add_global(cg.RawExpression(f"static {P1MiniStagedText} {staged_texts_id}[{len(text_sensors)}]"))
+        cg.add(var.set_text_sensor_storage(cg.RawExpression(nodes_id), num_nodes, cg.RawExpression(staged_texts_id), len(text_sensors)))
+        if config[CONF_STREAMING]:
+            # The lines are gone from the buffer before they are published, so each value is
+            # kept in a slot of max_line_length
+            text_values_size = len(text_sensors) * config[CONF_MAX_LINE_LENGTH]
+            text_values_id = f"{prefix}_text_values"
+            cg.add_global(cg.RawExpression(f"static char {text_values_id}[{text_values_size}]"))
+            cg.add(var.set_text_value_storage(cg.RawExpression(text_values_id), text_values_size, config[CONF_MAX_LINE_LENGTH]))
+
+    for key, name, trigger_class in TRIGGERS:
+        num_triggers = len(config.get(key, []))
+        if num_triggers:
+            triggers_id = f"{prefix}_{name}_triggers"
+            cg.add_global(cg.RawExpression(f"static {trigger_class} *{triggers_id}[{num_triggers}]"))
+            cg.add(getattr(var, f"set_{name}_trigger_storage")(cg.RawExpression(triggers_id), num_triggers))
+
+    if CONF_HISTORY in config:
+        # Three sets of values: at the oldest sample, at the newest and the next one
+        history = config[CONF_HISTORY]
+        path = history.get(CONF_PATH, f"/{prefix}/history")
+        num_values = len(sensors)
+        history_server_id = f"{prefix}_history_server"
+        history_values_id = f"{prefix}_history_values"
+        history_buffer_id = f"{prefix}_history_buffer"
+        cg.add_global(cg.RawExpression(f"static {P1MiniHistoryServer} {history_server_id}{{ {cg.safe_exp(path)} }}"))
+        cg.add_global(cg.RawExpression(f"static int64_t {history_values_id}[{max(1, 3 * num_values)}]"))
+        cg.add_global(cg.RawExpression(f"static uint8_t {history_buffer_id}[{history[CONF_SIZE]}]"))
+        obis_codes_id = f"{prefix}_sensor_obis_codes" if sensors else "nullptr"
+        cg.add(cg.RawExpression(f"{history_server_id}.SetStorage({obis_codes_id}, {num_values}, {history_values_id}, {history_buffer_id}, {history[CONF_SIZE]})"))
+        cg.add(var.set_history_server(cg.RawExpression(f"&{history_server_id}")))
+
+    num_time_sensors = sum(1 for key in [*TIME_STAGES, CONF_PROCESSING_SLICES] if key in config.get(CONF_DIAGNOSTICS, {}))
+    if num_time_sensors:
+        time_sensors_id = f"{prefix}_time_sensors"
+        cg.add_global(cg.RawExpression(f"static {P1MiniTimeSensor} {time_sensors_id}[{num_time_sensors}]"))
+        cg.add(var.set_time_sensor_storage(cg.RawExpression(time_sensors_id), num_time_sensors))
+
+OBIS_FULL_RE = re.compile(r"^(\d{1,3})-(\d{1,3}):(\d{1,3})\.(\d{1,3})\.(\d{1,3})$")
+OBIS_SIMPLE_RE = re.compile(r"^(\d{1,3})\.(\d{1,3})\.(\d{1,3})$")
+
 def obis_code(value):
     value = cv.string(value)
 
     # Check for full OBIS code format: A-B:C.D.E (e.g., "0-1:24.2.3")
-    full_obis_match = re.match(r"^\d{1,3}-\d{1,3}:\d{1,3}\.\d{1,3}\.\d{1,3}$", value)
+    full_obis_match = OBIS_FULL_RE.match(value)
 
     # Check for simple format: C.D.E (e.g., "22.7.0")
-    simple_obis_match = re.match(r"^\d{1,3}\.\d{1,3}\.\d{1,3}$", value)
+    simple_obis_match = OBIS_SIMPLE_RE.match(value)
 
-    if full_obis_match or simple_obis_match:
-        return value
-    else:
+    match = full_obis_match or simple_obis_match
+    if not match:
         raise cv.Invalid(f"{value} is not a valid OBIS code. Supported formats: 'A-B:C.D.E' (e.g., '0-1:24.2.3') or 'C.D.E' (e.g., '22.7.0')")
+    if any(int(group) > 255 for group in match.groups()):
+        raise cv.Invalid(f"{value} is not a valid OBIS code. Each value must be in the range 0-255")
+    return value
+
+# Pack an OBIS code into the 64 bit key used by the component (see OBIS() in p1_mini.cpp).
+# Codes in the simple format (C.D.E) match any A and B, which is marked by bit 40.
+OBIS_ANY_A_B = 1 << 40
+
+def obis_key(value):
+    full_obis_match = OBIS_FULL_RE.match(value)
+    if full_obis_match:
+        a, b, c, d, e = (int(group) for group in full_obis_match.groups())
+        return a << 32 | b << 24 | c << 16 | d << 8 | e
+    c, d, e = (int(group) for group in OBIS_SIMPLE_RE.match(value).groups())
+    return OBIS_ANY_A_B | c << 16 | d << 8 | e
 
 def identifier(value):
     value = cv.string(value)
     return value
+
+# The slots of the sensor table of one p1_mini instance, sorted by key:
+# - one for each sensor or text sensor with an OBIS code
+# - one for each source of a derived sensor, without a sensor
+# - one for the result of each derived sensor, with a key that matches no OBIS code
+SensorSlot = namedtuple("SensorSlot", ["key", "sensor_id", "source_of", "derived"])
+OBIS_DERIVED = 1 << 41
+
+def sensor_table(p1_mini_id, full_config=None):
+    full_config = full_config or CORE.config
+    slots = []
+    sensors = [
+        conf for conf in full_config.get(CONF_SENSOR, [])
+        if conf[CONF_PLATFORM] == "p1_mini" and conf[CONF_P1_MINI_ID].id == p1_mini_id.id
+    ]
+    num_derived = 0
+    for conf in sensors:
+        sensor_id = conf[CONF_ID].id
+        if CONF_OBIS_CODE in conf:
+            slots.append(SensorSlot(obis_key(conf[CONF_OBIS_CODE]), sensor_id, None, None))
+            continue
+        slots.append(SensorSlot(OBIS_DERIVED | num_derived, sensor_id, None, conf[CONF_DERIVED]))
+        num_derived += 1
+        for index, source in enumerate(conf[CONF_DERIVED][CONF_SOURCES]):
+            slots.append(SensorSlot(obis_key(source), None, (sensor_id, index), None))
+    for conf in full_config.get(CONF_TEXT_SENSOR, []):
+        if conf[CONF_PLATFORM] == "p1_mini" and conf[CONF_P1_MINI_ID].id == p1_mini_id.id and CONF_OBIS_CODE in conf:
+            slots.append(SensorSlot(obis_key(conf[CONF_OBIS_CODE]), conf[CONF_ID].id, None, None))
+    return sorted(slots, key=lambda slot: slot.key)
+
+# The position of a sensor in the sensor table
+def sensor_slot(p1_mini_id, sensor_id):
+    return [slot.sensor_id for slot in sensor_table(p1_mini_id)].index(sensor_id.id)
+
+# The text sensors that get lines by identifier
+def instance_text_sensors(p1_mini_id):
+    return [
+        conf for conf in CORE.config.get(CONF_TEXT_SENSOR, [])
+        if conf[CONF_PLATFORM] == "p1_mini" and conf[CONF_P1_MINI_ID].id == p1_mini_id.id and CONF_IDENTIFIER in conf
+    ]
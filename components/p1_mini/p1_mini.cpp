@@ -25,478 +25,714 @@
 // IN THE SOFTWARE.
 //-------------------------------------------------------------------------------------
 
+#include "esphome/core/defines.h"
+#include "esphome/core/hal.h"
 #include "esphome/core/log.h"
 #include "p1_mini.h"
+#include "p1_mini_crc.h"
+
+#ifdef USE_ESP32
+#include <esp_heap_caps.h>
+#endif
+#ifdef USE_P1_MINI_RECEIVE_TASK
+#include "esphome/components/uart/uart_component_esp_idf.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
 
 namespace esphome {
     namespace p1_mini {
 
         namespace {
-            // Combine the three values defining a sensor into a single unsigned int for easier
-            // handling and comparison
-            inline uint32_t OBIS(uint32_t major, uint32_t minor, uint32_t micro)
-            {
-                return (major & 0xfff) << 16 | (minor & 0xff) << 8 | (micro & 0xff);
-            }
-
-            constexpr static uint32_t OBIS_ERROR{ 0xffffffff };
-
-            inline uint32_t OBIS(char const *code)
-            {
-                uint32_t a_part{ 0 };
-                uint32_t b_part{ 0 };
-                uint32_t major{ 0 };
-                uint32_t minor{ 0 };
-                uint32_t micro{ 0 };
-
-                char const *C{ code };
-
-                // Parse first number
-                while (std::isdigit(*C)) a_part = a_part * 10 + (*C++ - '0');
-                if (*C == '\0') return OBIS_ERROR;
-
-                // Check if this is full format (A-B:C.D.E) or simple format (C.D.E)
-                if (*C == '-') {
-                    // Full format: A-B:C.D.E
-                    C++; // Skip the '-'
-                    while (std::isdigit(*C)) b_part = b_part * 10 + (*C++ - '0');
-                    if (*C++ != ':') return OBIS_ERROR;
-                    while (std::isdigit(*C)) major = major * 10 + (*C++ - '0');
-                    if (*C++ != '.') return OBIS_ERROR;
-                    while (std::isdigit(*C)) minor = minor * 10 + (*C++ - '0');
-                    if (*C++ != '.') return OBIS_ERROR;
-                    while (std::isdigit(*C)) micro = micro * 10 + (*C++ - '0');
-                    if (*C != '\0') return OBIS_ERROR;
-                } else if (*C == '.') {
-                    // Simple format: C.D.E (treat first parsed number as major)
-                    major = a_part;
-                    C++; // Skip the '.'
-                    while (std::isdigit(*C)) minor = minor * 10 + (*C++ - '0');
-                    if (*C++ != '.') return OBIS_ERROR;
-                    while (std::isdigit(*C)) micro = micro * 10 + (*C++ - '0');
-                    if (*C != '\0') return OBIS_ERROR;
-                } else {
-                    return OBIS_ERROR;
-                }
+            constexpr static const char *TAG = "P1Mini";
+
+        }
+
+
+        P1MiniSensorBase::P1MiniSensorBase(uint64_t obis)
+            : m_obis{ obis }
+        {
+        }
 
-                return OBIS(major, minor, micro);
+        P1MiniTextSensorBase::P1MiniTextSensorBase(char const *identifier)
+            : m_identifier{ identifier }
+        {
+            //ESP_LOGI(TAG, "New text sensor: '%s'", identifier.c_str());
+        }
+
+        P1Mini::P1Mini(uint32_t min_period_ms, int buffer_size, buffer_locations buffer_location)
+            : m_error_recovery_time{ millis() }
+            , m_min_period_ms{ min_period_ms }
+            , m_period_ms{ min_period_ms }
+            , m_buffer_location{ buffer_location }
+        {
+            m_message.size = buffer_size;
+            if (m_buffer_location != buffer_locations::STATIC) AllocateBuffer(m_message, m_message_buffer_UP, buffer_size);
+            m_text_sensor_trie.set_storage(&m_text_sensor_trie_root, 1);
+            m_text_sensor_trie.push_back({});
+        }
+
+        void P1Mini::set_static_buffers(char *buffer, char *next_buffer)
+        {
+            m_message.buffer = buffer;
+            m_static_next_buffer = next_buffer;
+        }
+
+        void P1Mini::enable_double_buffering()
+        {
+            if (m_buffer_location == buffer_locations::STATIC) {
+                m_next_message.buffer = m_static_next_buffer;
+                m_next_message.size = m_message.size;
             }
+            else AllocateBuffer(m_next_message, m_next_message_buffer_UP, m_message.size);
+        }
 
-            uint16_t crc16_ccitt_false(char *pData, int length) {
-                int i;
-                uint16_t wCrc = 0;
-                while (length--) {
-                    wCrc ^= *(unsigned char *)pData++;
-                    for (i = 0; i < 8; i++)
-                        wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ 0xA001 : wCrc >> 1;
-                }
-                return wCrc;
+        bool P1Mini::AllocateBuffer(Message &message, BufferOwner &owner, int size)
+        {
+            char *buffer{ nullptr };
+            size_t const bytes{ static_cast<size_t>(size) + 1 }; // Room for a terminator after a full buffer
+#ifdef USE_ESP32
+            if (m_buffer_location == buffer_locations::PSRAM) {
+                buffer = static_cast<char *>(heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+                if (buffer == nullptr) ESP_LOGW(TAG, "Failed to allocate %d bytes for buffer in PSRAM. Using internal RAM.", size);
             }
+#endif
+            if (buffer == nullptr) buffer = static_cast<char *>(std::malloc(bytes));
+            if (buffer == nullptr) {
+                ESP_LOGE(TAG, "Failed to allocate %d bytes for buffer.", size);
+                return false;
+            }
+            owner.reset(buffer);
+            message.buffer = buffer;
+            message.size = size;
+            return true;
+        }
 
-            uint16_t crc16_x25(char *pData, int length) {
-                int i;
-                uint16_t wCrc = 0xffff;
-                while (length--) {
-                    wCrc ^= *(unsigned char *)pData++ << 0;
-                    for (i = 0; i < 8; i++)
-                        wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ 0x8408 : wCrc >> 1;
-                }
-                return wCrc ^ 0xffff;
+        void P1Mini::setup() {
+            //ESP_LOGD("P1Mini", "setup()");
+            if (m_message.buffer == nullptr) {
+                ESP_LOGE(TAG, "No buffer of %d bytes for the messages. Use a smaller buffer_size or buffer_location: static.", m_message.size);
+                mark_failed();
+                return;
+            }
+            if (m_engine == nullptr) {
+                ESP_LOGE(TAG, "No parsing engine.");
+                mark_failed();
+                return;
             }
+            if (m_passthrough_uart == nullptr) m_passthrough_uart = parent_;
+#ifdef USE_P1_MINI_RECEIVE_TASK
+            if (m_receive_task != nullptr && !m_receive_task->Start(static_cast<uart_port_t>(static_cast<uart::IDFUARTComponent *>(parent_)->get_hw_serial_number()))) {
+                ESP_LOGE(TAG, "Failed to start the receive task. Reading from the UART in loop() instead.");
+                m_receive_task = nullptr;
+            }
+#endif
+            for (int i{ 0 }; i < m_num_derived_values; ++i) {
+                P1MiniDerivedValue const &derived{ m_derived_values[i] };
+                for (int j{ 0 }; j < derived.num_sources; ++j) m_sensors[derived.sources[j]].required = true;
+            }
+            if (!m_time_sensors.empty() || std::any_of(std::begin(m_error_sensors), std::end(m_error_sensors), [](sensor::Sensor *S) { return S != nullptr; })) {
+                set_interval("diagnostics", m_diagnostics_interval_ms, [this]() { PublishDiagnostics(); });
+            }
+        }
 
-            constexpr static const char *TAG = "P1Mini";
+        void RollingStats::Add(unsigned long value)
+        {
+            m_samples[m_next_sample] = std::min<unsigned long>(value, 0xffff);
+            m_next_sample = (m_next_sample + 1) % window_size;
+            if (m_num_samples < window_size) ++m_num_samples;
+        }
 
+        float RollingStats::Get(time_statistics statistic) const
+        {
+            if (m_num_samples == 0) return NAN;
+            switch (statistic) {
+            case time_statistics::MIN:
+                return *std::min_element(m_samples, m_samples + m_num_samples);
+            case time_statistics::MAX:
+                return *std::max_element(m_samples, m_samples + m_num_samples);
+            case time_statistics::AVG: {
+                uint32_t sum{ 0 };
+                for (int i{ 0 }; i < m_num_samples; ++i) sum += m_samples[i];
+                return static_cast<float>(sum) / m_num_samples;
+            }
+            case time_statistics::P95: {
+                uint16_t sorted[window_size];
+                std::copy(m_samples, m_samples + m_num_samples, sorted);
+                uint16_t *const nth{ sorted + (m_num_samples * 95 + 99) / 100 - 1 };
+                std::nth_element(sorted, nth, sorted + m_num_samples);
+                return *nth;
+            }
+            }
+            return NAN;
+        }
 
+        void P1Mini::PublishDiagnostics()
+        {
+            for (P1MiniTimeSensor const &time_sensor : m_time_sensors) {
+                time_sensor.sensor->publish_state(m_time_stats[static_cast<int>(time_sensor.stage)].Get(time_sensor.statistic));
+            }
+            for (int i{ 0 }; i < num_error_counters; ++i) {
+                if (m_error_sensors[i] != nullptr) m_error_sensors[i]->publish_state(m_error_counts[i]);
+            }
+        }
 
+        void P1Mini::StartPassthrough(Message const &message)
+        {
+            DetachPassthrough();
+            if (!m_secondary_p1) return;
+            m_passthrough_message = &message;
+            m_passthrough_position = message.position;
         }
 
+        void P1Mini::QueuePassthrough(char const *data, int length)
+        {
+            for (; length > 0; --length) {
+                if (m_passthrough_ring_count == passthrough_ring_size) {
+                    ++m_passthrough_dropped;
+                    continue;
+                }
+                m_passthrough_ring[(m_passthrough_ring_start + m_passthrough_ring_count++) % passthrough_ring_size] = *data++;
+            }
+        }
 
-        P1MiniSensorBase::P1MiniSensorBase(std::string obis_code)
-            : m_obis{ OBIS(obis_code.c_str()) }
+        void P1Mini::DetachPassthrough()
         {
-            if (m_obis == OBIS_ERROR) ESP_LOGE(TAG, "Not a valid OBIS code: '%s'", obis_code.c_str());
+            // The buffer of the message will be reused, so queue whatever is left to send
+            if (m_passthrough_message != nullptr) {
+                QueuePassthrough(m_passthrough_message->buffer + m_passthrough_position, m_passthrough_message->position - m_passthrough_position);
+                m_passthrough_message = nullptr;
+            }
         }
 
-        P1MiniTextSensorBase::P1MiniTextSensorBase(std::string identifier)
-            : m_identifier{ identifier }
+        void P1Mini::SendPassthrough(unsigned long current_time)
         {
-            //ESP_LOGI(TAG, "New text sensor: '%s'", identifier.c_str());
+            // Only send as much as the UART can have sent since last time
+            unsigned long const elapsed_time{ current_time - m_passthrough_time };
+            m_passthrough_time = current_time;
+            int budget{ passthrough_max_burst };
+            if (elapsed_time < 1000) budget = std::min<int>(budget, std::max<unsigned long>(1, elapsed_time * m_passthrough_uart->get_baud_rate() / 10000));
+
+            while (budget > 0 && m_passthrough_ring_count > 0) {
+                int const length{ std::min({ budget, m_passthrough_ring_count, passthrough_ring_size - m_passthrough_ring_start }) };
+                m_passthrough_uart->write_array(reinterpret_cast<uint8_t const *>(m_passthrough_ring + m_passthrough_ring_start), length);
+                m_passthrough_ring_start = (m_passthrough_ring_start + length) % passthrough_ring_size;
+                m_passthrough_ring_count -= length;
+                budget -= length;
+            }
+            if (budget > 0 && m_passthrough_message != nullptr) {
+                int const length{ std::min(budget, m_passthrough_message->position - m_passthrough_position) };
+                if (length > 0) {
+                    m_passthrough_uart->write_array(reinterpret_cast<uint8_t const *>(m_passthrough_message->buffer + m_passthrough_position), length);
+                    m_passthrough_position += length;
+                }
+            }
+            if (m_passthrough_dropped != 0) {
+                ESP_LOGW(TAG, "Passthrough could not keep up. %d bytes dropped.", m_passthrough_dropped);
+                m_passthrough_dropped = 0;
+            }
         }
 
-        P1Mini::P1Mini(uint32_t min_period_ms, int buffer_size)
-            : m_error_recovery_time{ millis() }
-            , m_message_buffer_size{ buffer_size }
-            , m_min_period_ms{ min_period_ms }
+        P1Mini::receive_results P1Mini::IdentifyMessage(Message &message, char read_byte)
         {
-            m_message_buffer = new char[m_message_buffer_size];
-            if (m_message_buffer == nullptr) {
-                ESP_LOGE(TAG, "Failed to allocate %d bytes for buffer.", m_message_buffer_size);
-                static char dummy[2];
-                m_message_buffer = dummy;
-                m_message_buffer_size = 2;
+            StartPassthrough(message);
+            message.line_position = message.position;
+            if (ascii_format_supported && read_byte == '/') {
+                ESP_LOGD(TAG, "ASCII data format");
+                message.format = data_formats::ASCII;
+            }
+            else if (binary_format_supported && read_byte == 0x7e) {
+                ESP_LOGD(TAG, "BINARY data format");
+                message.format = data_formats::BINARY;
             }
             else {
-                m_message_buffer_UP.reset(m_message_buffer);
+                ESP_LOGW(TAG, "Unknown data format (0x%02x). Resetting.", read_byte);
+                CountError(error_counters::UNKNOWN_FRAMES);
+                return receive_results::FAILED;
             }
+            message.buffer[message.position++] = read_byte;
+            // The leading flag of a binary frame is not part of the CRC
+            if constexpr (!binary_format_supported) message.crc = crc16_ccitt_false(crc16_ccitt_false_init, read_byte);
+            else if constexpr (!ascii_format_supported) message.crc = crc16_x25_init;
+            else message.crc = message.format == data_formats::ASCII ? crc16_ccitt_false(crc16_ccitt_false_init, read_byte) : crc16_x25_init;
+            return receive_results::COMPLETE;
         }
 
-        void P1Mini::setup() {
-            //ESP_LOGD("P1Mini", "setup()");
+        // Tokenize the line that ends at the current position and stage its values. They are
+        // not published unless the CRC of the whole message turns out to be correct.
+        void P1Mini::ParseStreamedLine(Message &message)
+        {
+            char *const end{ message.buffer + message.position };
+            char const next{ *end }; // Possibly received, but not yet scanned
+            *end = '\0';
+            Parser().StartAscii(message.buffer + message.line_position);
+            while (Parser().ParseNext() == P1MiniParser::results::INCOMPLETE) {}
+            *end = next;
+            message.line_position = message.position;
         }
 
-        void P1Mini::loop() {
-            unsigned long const loop_start_time{ millis() };
-            switch (m_state) {
-            case states::IDENTIFYING_MESSAGE:
-                if (!available()) {
-                    constexpr unsigned long max_wait_time_ms{ 60000 };
-                    if (max_wait_time_ms < loop_start_time - m_identifying_message_time) {
-                        ESP_LOGW(TAG, "No data received for %d seconds.", max_wait_time_ms / 1000);
-                        ChangeState(states::ERROR_RECOVERY);
-                    }
-                    break;
+        // Drop the lines that have already been handled from the start of the buffer, so that
+        // it only has to hold the line being received
+        void P1Mini::CompactMessage(Message &message)
+        {
+            int const shift{ message.line_position };
+            if (m_passthrough_message == &message) {
+                if (m_passthrough_position < shift) {
+                    QueuePassthrough(message.buffer + m_passthrough_position, shift - m_passthrough_position);
+                    m_passthrough_position = 0;
                 }
-                {
-                    char const read_byte{ GetByte() };
-                    if (read_byte == '/') {
-                        ESP_LOGD(TAG, "ASCII data format");
-                        m_data_format = data_formats::ASCII;
-                    }
-                    else if (read_byte == 0x7e) {
-                        ESP_LOGD(TAG, "BINARY data format");
-                        m_data_format = data_formats::BINARY;
+                else m_passthrough_position -= shift;
+            }
+            memmove(message.buffer, message.buffer + shift, message.position - shift);
+            message.position -= shift;
+            if (message.crc_position != 0) message.crc_position -= shift;
+            message.line_position = 0;
+        }
+
+        int P1Mini::MaxBytesToRead(Message const &message)
+        {
+            int const max_bytes{ message.size - message.position };
+            if (!binary_format_supported || message.format != data_formats::BINARY) return max_bytes;
+            // The next frame of a segmented message may follow right after this one, so
+            // never read beyond the end of the frame. Its length is known after three bytes.
+            int const end_of_frame{ message.crc_position == 0 ? 3 : message.crc_position + 3 };
+            return std::min(max_bytes, end_of_frame - message.position);
+        }
+
+        P1Mini::receive_results P1Mini::ReadMessage(Message &message)
+        {
+            while (int const num_bytes{ ReadBlock(message.buffer + message.position, MaxBytesToRead(message)) }) {
+                // Read all available data into the buffer in one go and then scan the new
+                // bytes for the framing. Should the block contain more than the end of this
+                // message, the rest is dropped.
+                int end_of_block{ message.position + num_bytes };
+                while (message.position != end_of_block) {
+                    char const read_byte{ message.buffer[message.position++] };
+
+                    // Flags may be repeated between HDLC frames, and a resynchronization may
+                    // have started on the closing flag of the previous frame. Keep the last one.
+                    if (binary_format_supported && message.format == data_formats::BINARY && message.position == 2 && read_byte == 0x7e) {
+                        std::copy(message.buffer + 2, message.buffer + end_of_block, message.buffer + 1);
+                        --end_of_block;
+                        --message.position;
+                        continue;
                     }
-                    else {
-                        ESP_LOGW(TAG, "Unknown data format (0x%02x). Resetting.", read_byte);
-                        ChangeState(states::ERROR_RECOVERY);
-                        return;
+
+                    // Update the CRC with every byte up until the CRC itself
+                    if (message.crc_position == 0 || message.position <= message.crc_position) {
+                        if constexpr (!binary_format_supported) message.crc = crc16_ccitt_false(message.crc, read_byte);
+                        else if constexpr (!ascii_format_supported) message.crc = crc16_x25(message.crc, read_byte);
+                        else message.crc = message.format == data_formats::ASCII ? crc16_ccitt_false(message.crc, read_byte) : crc16_x25(message.crc, read_byte);
                     }
-                    m_message_buffer[m_message_buffer_position++] = read_byte;
-                    ChangeState(states::READING_MESSAGE);
-                }
-                // Not breaking here! The delay caused by exiting the loop function here can cause
-                // the UART buffer to overflow, so instead, go directly into the READING_MESSAGE
-                // part.
-            case states::READING_MESSAGE:
-                ++m_num_message_loops;
-                while (available()) {
-                    // While data is available, read it one byte at a time.
-                    char const read_byte{ GetByte() };
 
-                    m_message_buffer[m_message_buffer_position++] = read_byte;
+                    // When streaming, each line is handled as soon as it is complete
+                    if (ascii_format_supported && m_streaming && read_byte == '\n' && message.crc_position == 0 && message.format == data_formats::ASCII) {
+                        ParseStreamedLine(message);
+                    }
 
                     // Find out where CRC will be positioned
-                    if (m_data_format == data_formats::ASCII && read_byte == '!') {
+                    if (ascii_format_supported && message.format == data_formats::ASCII && read_byte == '!') {
                         // The exclamation mark indicates that the main message is complete
                         // and the CRC will come next.
-                        m_crc_position = m_message_buffer_position;
+                        message.crc_position = message.position;
                     }
-                    else if (m_data_format == data_formats::BINARY && m_message_buffer_position == 3) {
-                        if ((0xe0 & m_message_buffer[1]) != 0xa0) {
+                    else if (binary_format_supported && message.format == data_formats::BINARY && message.position == 3) {
+                        if ((0xf0 & message.buffer[1]) != 0xa0) {
                             ESP_LOGW(TAG, "Unknown frame format (0x%02X). Resetting.", read_byte);
-                            ChangeState(states::ERROR_RECOVERY);
-                            return;
+                            CountError(error_counters::UNKNOWN_FRAMES);
+                            return receive_results::FAILED;
                         }
-                        m_crc_position = ((0x1f & m_message_buffer[1]) << 8) + m_message_buffer[2] - 1;
+                        // Frame format type 3: 4 bits type, the segmentation bit and 11 bits length
+                        message.crc_position = ((0x07 & message.buffer[1]) << 8) + static_cast<uint8_t>(message.buffer[2]) - 1;
                     }
 
-                    // If end of CRC is reached, start verifying CRC
-                    if (m_crc_position > 0 && m_message_buffer_position > m_crc_position) {
-                        if (m_data_format == data_formats::ASCII && read_byte == '\n') {
-                            ChangeState(states::VERIFYING_CRC);
-                            return;
+                    // If end of CRC is reached, the message is complete
+                    if (message.crc_position > 0 && message.position > message.crc_position) {
+                        if (ascii_format_supported && message.format == data_formats::ASCII && read_byte == '\n') {
+                            return receive_results::COMPLETE;
                         }
-                        else if (m_data_format == data_formats::BINARY && m_message_buffer_position == m_crc_position + 3) {
+                        else if (binary_format_supported && message.format == data_formats::BINARY && message.position == message.crc_position + 3) {
                             if (read_byte != 0x7e) {
                                 ESP_LOGW(TAG, "Unexpected end. Resetting.");
-                                ChangeState(states::ERROR_RECOVERY);
-                                return;
+                                CountError(error_counters::UNKNOWN_FRAMES);
+                                return receive_results::FAILED;
                             }
-                            ChangeState(states::VERIFYING_CRC);
-                            return;
+                            return receive_results::COMPLETE;
                         }
                     }
-                    if (m_message_buffer_position == m_message_buffer_size) {
-                        ESP_LOGW(TAG, "Message buffer overrun. Resetting.");
+                }
+                if (message.line_position != 0) CompactMessage(message);
+                if (message.position == message.size) {
+                    ESP_LOGW(TAG, "Message buffer overrun. Resetting.");
+                    CountError(error_counters::BUFFER_OVERRUNS);
+                    return receive_results::FAILED;
+                }
+            }
+            return receive_results::INCOMPLETE;
+        }
+
+        void P1Mini::ReceiveNextMessage(unsigned long loop_start_time)
+        {
+            switch (m_next_message_state) {
+            case next_message_states::IDLE:
+            case next_message_states::COMPLETE:
+            case next_message_states::FAILED:
+                break;
+            case next_message_states::WAITING:
+                if (m_period_ms == 0 || IsSegment(m_message) || m_period_ms < loop_start_time - m_identifying_message_time) {
+                    m_next_identifying_message_time = loop_start_time;
+                    DetachPassthrough();
+                    m_secondary_p1 = m_secondary_rts != nullptr && m_secondary_rts->state;
+                    m_next_message.position = m_next_message.crc_position = 0;
+                    m_next_message.format = data_formats::UNKNOWN;
+                    m_next_message_state = next_message_states::IDENTIFYING;
+                    if (!IsSegment(m_message)) for (auto T : m_ready_to_receive_triggers) T->trigger();
+                }
+                break;
+            case next_message_states::IDENTIFYING:
+                if (!BytesAvailable()) break;
+                if (IdentifyMessage(m_next_message, GetByte()) == receive_results::FAILED) {
+                    m_next_message_state = next_message_states::FAILED;
+                    break;
+                }
+                m_next_reading_message_time = loop_start_time;
+                m_next_message_state = next_message_states::READING;
+                for (auto T : m_receiving_update_triggers) T->trigger();
+                // Not breaking here, for the same reason as in loop()
+            case next_message_states::READING:
+                switch (ReadMessage(m_next_message)) {
+                case receive_results::INCOMPLETE:
+                    break;
+                case receive_results::COMPLETE:
+                    m_next_message_state = next_message_states::COMPLETE;
+                    if (!IsSegment(m_next_message)) for (auto T : m_update_received_triggers) T->trigger();
+                    break;
+                case receive_results::FAILED:
+                    m_next_message_state = next_message_states::FAILED;
+                    break;
+                }
+                break;
+            }
+        }
+
+        void P1Mini::TakeOverNextMessage()
+        {
+            // Continue with the next message, from wherever its reception has got to
+            std::swap(m_message, m_next_message);
+            if (m_passthrough_message == &m_next_message) m_passthrough_message = &m_message;
+            else if (m_passthrough_message == &m_message) m_passthrough_message = &m_next_message;
+            m_identifying_message_time = m_next_identifying_message_time;
+            m_reading_message_time = m_next_reading_message_time;
+            m_num_message_loops = m_num_processing_loops = m_num_publishing_loops = 0;
+            switch (m_next_message_state) {
+            case next_message_states::IDENTIFYING:
+                m_state = states::IDENTIFYING_MESSAGE;
+                break;
+            case next_message_states::READING:
+                m_state = states::READING_MESSAGE;
+                break;
+            case next_message_states::COMPLETE:
+                m_verifying_crc_time = millis();
+                m_state = states::VERIFYING_CRC;
+                break;
+            default:
+                break;
+            }
+            m_next_message_state = next_message_states::IDLE;
+        }
+
+        void P1Mini::SendRawTelegram()
+        {
+            // The whole frame, from the first byte up to and including the CRC and, in the HDLC
+            // case, the closing flag
+#ifdef USE_P1_MINI_RAW_MQTT
+            if (!m_raw_mqtt_topic.empty() && mqtt::global_mqtt_client != nullptr && mqtt::global_mqtt_client->is_connected()) {
+                mqtt::global_mqtt_client->publish(m_raw_mqtt_topic, m_message.buffer, m_message.position);
+            }
+#endif
+#ifdef USE_P1_MINI_RAW_UDP
+            if (m_raw_udp != nullptr) m_raw_udp->send_packet(reinterpret_cast<uint8_t const *>(m_message.buffer), m_message.position);
+#endif
+#ifdef USE_P1_MINI_TCP_SERVER
+            if (m_tcp_server != nullptr) m_tcp_server->Send(m_message.buffer, m_message.position);
+#endif
+        }
+
+        // The frame that was just processed is followed by another frame of the same message.
+        // Receive it right away, or continue with it if it is already being received.
+        void P1Mini::ContinueWithNextFrame()
+        {
+            switch (m_next_message_state) {
+            case next_message_states::IDLE:
+            case next_message_states::WAITING:
+                m_next_message_state = next_message_states::IDLE;
+                ChangeState(states::IDENTIFYING_MESSAGE);
+                break;
+            case next_message_states::FAILED:
+                ChangeState(states::ERROR_RECOVERY);
+                break;
+            default:
+                TakeOverNextMessage();
+                break;
+            }
+        }
+
+        void P1Mini::loop() {
+            unsigned long const loop_start_time{ millis() };
+            if (m_passthrough_message != nullptr || m_passthrough_ring_count != 0) SendPassthrough(loop_start_time);
+#ifdef USE_P1_MINI_RECEIVE_TASK
+            if (m_receive_task != nullptr) {
+                uint32_t const dropped_bytes{ m_receive_task->TakeDroppedBytes() };
+                if (dropped_bytes != 0) {
+                    ESP_LOGW(TAG, "%u received bytes dropped, as they were not read in time.", static_cast<unsigned>(dropped_bytes));
+                    CountError(error_counters::BUFFER_OVERRUNS);
+                }
+            }
+#endif
+#ifdef USE_P1_MINI_TCP_SERVER
+            if (m_tcp_server != nullptr) m_tcp_server->Loop();
+#endif
+            switch (m_state) {
+            case states::IDENTIFYING_MESSAGE:
+                if (!BytesAvailable()) {
+                    constexpr unsigned long max_wait_time_ms{ 60000 };
+                    if (max_wait_time_ms < loop_start_time - m_identifying_message_time) {
+                        ESP_LOGW(TAG, "No data received for %d seconds.", max_wait_time_ms / 1000);
+                        CountError(error_counters::TIMEOUTS);
                         ChangeState(states::ERROR_RECOVERY);
-                        return;
                     }
-
+                    break;
+                }
+                if (IdentifyMessage(m_message, GetByte()) == receive_results::FAILED) {
+                    ChangeState(states::ERROR_RECOVERY);
+                    return;
+                }
+                ChangeState(states::READING_MESSAGE);
+                // Not breaking here! The delay caused by exiting the loop function here can cause
+                // the UART buffer to overflow, so instead, go directly into the READING_MESSAGE
+                // part.
+            case states::READING_MESSAGE:
+                ++m_num_message_loops;
+                switch (ReadMessage(m_message)) {
+                case receive_results::COMPLETE:
+                    ChangeState(states::VERIFYING_CRC);
+                    return;
+                case receive_results::FAILED:
+                    ChangeState(states::ERROR_RECOVERY);
+                    return;
+                case receive_results::INCOMPLETE:
+                    break;
                 }
                 {
                     constexpr unsigned long max_message_time_ms{ 10000 };
                     if (max_message_time_ms < loop_start_time - m_reading_message_time && m_reading_message_time < loop_start_time) {
                         ESP_LOGW(TAG, "Complete message not received within %d seconds. Resetting.", max_message_time_ms / 1000);
+                        CountError(error_counters::TIMEOUTS);
                         ChangeState(states::ERROR_RECOVERY);
                     }
                 }
                 break;
             case states::VERIFYING_CRC: {
+                // The CRC has already been calculated while the message was received,
+                // so all that is left is to compare it to the one in the message.
+                // Wait for the engine before anything is done with the message, so that it is
+                // verified, logged and sent on exactly once
+                bool const needs_parsing{ HasSensors() || IsSegment(m_message) || InSegmentedMessage() };
+                if (needs_parsing && !AcquireEngine()) return; // Another instance is parsing a message
+
                 int crc_from_msg = -1;
                 int crc = 0;
 
-                if (m_data_format == data_formats::ASCII) {
-                    crc_from_msg = (int)strtol(m_message_buffer + m_crc_position, NULL, 16);
-                    crc = crc16_ccitt_false(m_message_buffer, m_crc_position);
+                if (ascii_format_supported && m_message.format == data_formats::ASCII) {
+                    crc_from_msg = (int)strtol(m_message.buffer + m_message.crc_position, NULL, 16);
+                    crc = m_message.crc;
                 }
-                else if (m_data_format == data_formats::BINARY) {
-                    crc_from_msg = (m_message_buffer[m_crc_position + 1] << 8) + m_message_buffer[m_crc_position];
-                    crc = crc16_x25(&m_message_buffer[1], m_crc_position - 1);
+                else if (binary_format_supported && m_message.format == data_formats::BINARY) {
+                    crc_from_msg = (static_cast<uint8_t>(m_message.buffer[m_message.crc_position + 1]) << 8) + static_cast<uint8_t>(m_message.buffer[m_message.crc_position]);
+                    crc = m_message.crc ^ crc16_x25_final_xor;
                 }
                 
                 if (crc == crc_from_msg) {
                     ESP_LOGD(TAG, "CRC verification OK");
-                    ChangeState(m_data_format == data_formats::BINARY ? states::PROCESSING_BINARY : states::PROCESSING_ASCII);
+                    SendRawTelegram();
+                    if (!needs_parsing) {
+                        m_processing_time = m_publishing_time = millis(); // Nothing to process or publish
+                        ChangeState(states::WAITING);
+                        return;
+                    }
+                    ChangeState(m_message.format == data_formats::BINARY ? states::PROCESSING_BINARY : states::PROCESSING_ASCII);
                     return;
                 }
 
                 // CRC verification failed
                 ESP_LOGE(TAG, "CRC mismatch, calculated %04X != %04X. Buffer discarded.", crc, crc_from_msg);
-                for (int i{ 0 }; i < m_message_buffer_position; ++i) AddByteToDiscardLog(m_message_buffer[i]);
+                CountError(error_counters::CRC_ERRORS);
+                BackOffPeriod("CRC error");
+                for (int i{ 0 }; i < m_message.position; ++i) AddByteToDiscardLog(m_message.buffer[i]);
                 FlushDiscardLog();
                 ChangeState(states::ERROR_RECOVERY);
                 return;
             }
             case states::PROCESSING_ASCII:
+            case states::PROCESSING_BINARY:
+                ReceiveNextMessage(loop_start_time);
                 ++m_num_processing_loops;
-                do {
-                    while (*m_start_of_data == '\n' || *m_start_of_data == '\r') ++m_start_of_data;
-                    char *end_of_line{ m_start_of_data };
-                    while (*end_of_line != '\n' && *end_of_line != '\r' && *end_of_line != '\0' && *end_of_line != '!') ++end_of_line;
-                    char const end_of_line_char{ *end_of_line };
-                    *end_of_line = '\0';
-
-                    if (end_of_line != m_start_of_data) {
-                        int a_part{ -1 }, b_part{ -1 }, major{ -1 }, minor{ -1 }, micro{ -1 };
-                        double value{ -1.0 };
-                        bool matched_sensor{ false };
-                        bool is_sensor_line{ false };
-
-                        // Try to parse full OBIS format: A-B:C.D.E(value) or A-B:C.D.E(...)(value*unit)
-                        if (sscanf(m_start_of_data, "%d-%d:%d.%d.%d(", &a_part, &b_part, &major, &minor, &micro) == 5) {
-                            is_sensor_line = true;
-
-                            // Find the OBIS code end and start looking for numeric values
-                            char *obis_end = strchr(m_start_of_data, '(');
-                            if (obis_end != nullptr) {
-                                char *current_pos = obis_end;
-                                bool found_valid_value = false;
-
-                                // Look through all parentheses pairs to find a numeric value
-                                while (*current_pos != '\0' && *current_pos != '!' && !found_valid_value) {
-                                    // Find the opening parenthesis
-                                    current_pos = strchr(current_pos, '(');
-                                    if (current_pos == nullptr) break;
-
-                                    current_pos++; // Skip the '('
-
-                                    // Find the closing parenthesis
-                                    char *value_end = strchr(current_pos, ')');
-                                    if (value_end == nullptr) break;
-
-                                    // Temporarily null-terminate to parse this parentheses content
-                                    char saved_char = *value_end;
-                                    *value_end = '\0';
-
-                                    // Check if this looks like a timestamp (ends with W or S, or is a long number without decimals)
-                                    bool is_timestamp = false;
-                                    size_t content_len = strlen(current_pos);
-                                    if (content_len > 10 && (current_pos[content_len-1] == 'W' || current_pos[content_len-1] == 'S')) {
-                                        is_timestamp = true;
-                                    } else if (content_len > 10 && strspn(current_pos, "0123456789") == content_len) {
-                                        is_timestamp = true; // All digits and very long, likely timestamp
-                                    }
-
-                                    if (!is_timestamp) {
-                                        // Try to parse as a number, handling potential units
-                                        char *num_start = current_pos;
-                                        // Skip leading zeros and find first significant digit or decimal
-                                        while (*num_start == '0' && *(num_start + 1) != '.' && *(num_start + 1) != '\0') {
-                                            num_start++;
-                                        }
-
-                                        char *endptr;
-                                        double parsed_value = strtod(num_start, &endptr);
-
-                                        // Valid if we parsed something and there's either a decimal point or units after the number
-                                        if (endptr > num_start) {
-                                            value = parsed_value;
-                                            found_valid_value = true;
-                                            ESP_LOGD(TAG, "Parsed value %f from parentheses content: '%s'", value, current_pos);
-                                        }
-                                    } else {
-                                        ESP_LOGD(TAG, "Skipping timestamp content: '%s'", current_pos);
-                                    }
-
-                                    *value_end = saved_char;
-                                    current_pos = value_end + 1;
-                                }
-                            }
-                        }
-
-                        // Try to parse legacy format: 1-0:C.D.E(value) - for backward compatibility
-                        if (!is_sensor_line && sscanf(m_start_of_data, "1-0:%d.%d.%d(%lf", &major, &minor, &micro, &value) == 4) {
-                            is_sensor_line = true;
-                        }
-
-                        // Try to parse simple format: C.D.E(value) - for backward compatibility
-                        if (!is_sensor_line && sscanf(m_start_of_data, "%d.%d.%d(%lf", &major, &minor, &micro, &value) == 4) {
-                            is_sensor_line = true;
-                        }
-
-                        if (is_sensor_line) {
-                            auto iter{ m_sensors.find(OBIS(major, minor, micro)) };
-                            if (iter != m_sensors.end()) {
-                                matched_sensor = true;
-                                iter->second->publish_val(value);
-                            }
-                        }
-                        if (!matched_sensor) {
-                            for (IP1MiniTextSensor *text_sensor : m_text_sensors) {
-                                if (strncmp(m_start_of_data, text_sensor->Identifier().c_str(), text_sensor->Identifier().size()) == 0) {
-                                    matched_sensor = true;
-                                    text_sensor->publish_val(m_start_of_data);
-                                    break;
-                                }
-                            }
-                        }
-                        if (!matched_sensor) {
-                            if (is_sensor_line)
-                                ESP_LOGD(TAG, "No sensor matched line '%s' with obis code %d.%d.%d (parsed value: %f)", m_start_of_data, major, minor, micro, value);
-                            else
-                                ESP_LOGD(TAG, "No sensor matched line '%s'", m_start_of_data);
-                        }
-                    }
-                    *end_of_line = end_of_line_char;
-                    if (end_of_line_char == '\0' || end_of_line_char == '!') {
-                        ChangeState(states::WAITING);
-                        return;
-                    }
-                    m_start_of_data = end_of_line + 1;
-                } while (millis() - loop_start_time < 25);
-                break;
-            case states::PROCESSING_BINARY: {
-                ++m_num_processing_loops;
-                if (m_start_of_data == m_message_buffer) {
-                    m_start_of_data += 3;
-                    while (*m_start_of_data != 0x13 && m_start_of_data <= m_message_buffer + m_crc_position) ++m_start_of_data;
-                    if (m_start_of_data > m_message_buffer + m_crc_position) {
-                        ESP_LOGW(TAG, "Could not find control byte. Resetting.");
-                        ChangeState(states::ERROR_RECOVERY);
-                        return;
+                {
+                    // The parser keeps its position, so the slice can end after any step
+                    uint32_t const slice_start_us{ micros() };
+                    P1MiniParser::results result;
+                    do result = Parser().ParseNext();
+                    while (result == P1MiniParser::results::INCOMPLETE && micros() - slice_start_us < m_processing_budget_us);
+                    if (result == P1MiniParser::results::NEXT_FRAME) {
+                        ContinueWithNextFrame();
                     }
-                    m_start_of_data += 6;
-                }
-
-                do {
-                    uint8_t type = *m_start_of_data;
-                    switch (type) {
-                    case 0x00:
-                        m_start_of_data++;
-                        break;
-                    case 0x01: // array
-                        m_start_of_data += 2;
-                        break;
-                    case 0x02: // struct
-                        m_start_of_data += 2;
-                        break;
-                    case 0x06: {// unsigned double long
-                        uint32_t v = (*(m_start_of_data + 1) << 24 | *(m_start_of_data + 2) << 16 | *(m_start_of_data + 3) << 8 | *(m_start_of_data + 4));
-                        float fv = v * 1.0 / 1000;
-                        auto iter{ m_sensors.find(m_obis_code) };
-                        if (iter != m_sensors.end()) iter->second->publish_val(fv);
-                        m_start_of_data += 1 + 4;
-                        break;
+                    else if (result == P1MiniParser::results::COMPLETE) {
+                        if (Parser().Error() == P1MiniParser::errors::UNSUPPORTED_DATA_TYPE)
+                            ESP_LOGW(TAG, "Unsupported data type 0x%02x. Rest of message skipped.", Parser().ErrorData());
+                        ChangeState(states::PUBLISHING);
                     }
-                    case 0x09: // octet
-                        if (*(m_start_of_data + 1) == 0x06) {
-                            int minor{ -1 }, major{ -1 }, micro{ -1 };
-                            major = *(m_start_of_data + 4);
-                            minor = *(m_start_of_data + 5);
-                            micro = *(m_start_of_data + 6);
-
-                            m_obis_code = OBIS(major, minor, micro);
+                    else if (result == P1MiniParser::results::FAILED) {
+                        switch (Parser().Error()) {
+                        case P1MiniParser::errors::INVALID_HEADER:
+                            ESP_LOGW(TAG, "Invalid frame header. Resetting.");
+                            break;
+                        case P1MiniParser::errors::UNSUPPORTED_APDU:
+                            ESP_LOGW(TAG, "Unsupported APDU type 0x%02x. Resetting.", Parser().ErrorData());
+                            break;
+                        default:
+                            ESP_LOGW(TAG, "Invalid data (type 0x%02x). Resetting.", Parser().ErrorData());
+                            break;
                         }
-                        m_start_of_data += 2 + (int)*(m_start_of_data + 1);
-                        break;
-                    case 0x0a: // string
-                        m_start_of_data += 2 + (int)*(m_start_of_data + 1);
-                        break;
-                    case 0x0c: // datetime
-                        m_start_of_data += 13;
-                        break;
-                    case 0x0f: // scalar
-                        m_start_of_data += 2;
-                        break;
-                    case 0x10: {// unsigned long
-                        uint16_t v = (*(m_start_of_data + 1) << 8 | *(m_start_of_data + 2));
-                        float fv = v * 1.0 / 10;
-                        auto iter{ m_sensors.find(m_obis_code) };
-                        if (iter != m_sensors.end()) iter->second->publish_val(fv);
-                        m_start_of_data += 3;
-                        break;
-                    }
-                    case 0x12: {// signed long
-                        int16_t v = (*(m_start_of_data + 1) << 8 | *(m_start_of_data + 2));
-                        float fv = v * 1.0 / 10;
-                        auto iter{ m_sensors.find(m_obis_code) };
-                        if (iter != m_sensors.end()) iter->second->publish_val(fv);
-                        m_start_of_data += 3;
-                        break;
-                    }
-                    case 0x16: // enum
-                        m_start_of_data += 2;
-                        break;
-                    default:
-                        ESP_LOGW(TAG, "Unsupported data type 0x%02x. Resetting.", type);
+                        CountError(error_counters::UNKNOWN_FRAMES);
                         ChangeState(states::ERROR_RECOVERY);
-                        return;
                     }
-                    if (m_start_of_data >= m_message_buffer + m_crc_position) {
-                        ChangeState(states::WAITING);
-                        return;
-                    }
-                } while (millis() - loop_start_time < 25);
+                }
+                break;
+            case states::PUBLISHING: {
+                ReceiveNextMessage(loop_start_time);
+                // Publish a few sensors per loop, to spread the work of the sensors' consumers
+                ++m_num_publishing_loops;
+                constexpr int max_sensors_per_loop{ 4 };
+                int num_published{ 0 };
+                for (; m_publish_position < m_num_sensors && num_published < max_sensors_per_loop; ++m_publish_position) {
+                    P1MiniSensorSlot &slot{ m_sensors[m_publish_position] };
+                    if (!slot.pending) continue;
+                    slot.pending = false;
+                    if (slot.sensor == nullptr) continue; // Only a source of a derived value
+                    if (!slot.sensor->Enabled()) continue;
+                    slot.sensor->publish_val(slot.value);
+                    ++num_published;
+                }
+                // Then the text sensors
+                int const num_slots{ m_num_sensors + m_staged_texts.size() };
+                for (; m_publish_position < num_slots && num_published < max_sensors_per_loop; ++m_publish_position, ++num_published) {
+                    P1MiniStagedText const &staged_text{ m_staged_texts[m_publish_position - m_num_sensors] };
+                    staged_text.sensor->publish_val(std::string(staged_text.value, staged_text.length));
+                }
+                if (m_publish_position == num_slots) ChangeState(states::WAITING);
                 break;
             }
             case states::WAITING:
                 if (m_display_time_stats) {
                     m_display_time_stats = false;
+                    m_time_stats[static_cast<int>(time_stages::IDENTIFYING)].Add(m_reading_message_time - m_identifying_message_time);
+                    m_time_stats[static_cast<int>(time_stages::MESSAGE)].Add(m_processing_time - m_reading_message_time);
+                    m_time_stats[static_cast<int>(time_stages::PROCESSING)].Add(m_publishing_time - m_processing_time);
+                    m_time_stats[static_cast<int>(time_stages::PUBLISHING)].Add(m_waiting_time - m_publishing_time);
+                    m_time_stats[static_cast<int>(time_stages::TOTAL)].Add(m_waiting_time - m_identifying_message_time);
+                    m_time_stats[static_cast<int>(time_stages::PROCESSING_SLICES)].Add(m_num_processing_loops);
                     if (m_time_stats_as_info_next == ++m_time_stats_counter) {
                         m_time_stats_as_info_next <<= 1;
-                        ESP_LOGI(TAG, "Cycle times: Identifying = %d ms, Message = %d ms (%d loops), Processing = %d ms (%d loops), (Total = %d ms). %d bytes in buffer",
+                        ESP_LOGI(TAG, "Cycle times: Identifying = %d ms, Message = %d ms (%d loops), Processing = %d ms (%d loops), Publishing = %d ms (%d loops), (Total = %d ms). %d bytes in buffer",
                             m_reading_message_time - m_identifying_message_time,
                             m_processing_time - m_reading_message_time,
                             m_num_message_loops,
-                            m_waiting_time - m_processing_time,
+                            m_publishing_time - m_processing_time,
                             m_num_processing_loops,
+                            m_waiting_time - m_publishing_time,
+                            m_num_publishing_loops,
                             m_waiting_time - m_identifying_message_time,
-                            m_message_buffer_position
+                            m_message.position
                         );
                     }
                     else
-                        ESP_LOGD(TAG, "Cycle times: Identifying = %d ms, Message = %d ms (%d loops), Processing = %d ms (%d loops), (Total = %d ms). %d bytes in buffer",
+                        ESP_LOGD(TAG, "Cycle times: Identifying = %d ms, Message = %d ms (%d loops), Processing = %d ms (%d loops), Publishing = %d ms (%d loops), (Total = %d ms). %d bytes in buffer",
                             m_reading_message_time - m_identifying_message_time,
                             m_processing_time - m_reading_message_time,
                             m_num_message_loops,
-                            m_waiting_time - m_processing_time,
+                            m_publishing_time - m_processing_time,
                             m_num_processing_loops,
+                            m_waiting_time - m_publishing_time,
+                            m_num_publishing_loops,
                             m_waiting_time - m_identifying_message_time,
-                            m_message_buffer_position
+                            m_message.position
                     );
                 }
-                if (m_min_period_ms == 0 || m_min_period_ms < loop_start_time - m_identifying_message_time) {
-                    ChangeState(states::IDENTIFYING_MESSAGE);
+                switch (m_next_message_state) {
+                case next_message_states::IDLE:
+                    break;
+                case next_message_states::WAITING:
+                    m_next_message_state = next_message_states::IDLE;
+                    break;
+                case next_message_states::FAILED:
+                    m_next_message_state = next_message_states::IDLE;
+                    ChangeState(states::ERROR_RECOVERY);
+                    return;
+                default:
+                    TakeOverNextMessage();
+                    return;
+                }
+                if (PeriodElapsed(loop_start_time)) {
+                    // With a shared buffer, only one of the instances receives at a time
+                    if (!HoldsEngineWhileReceiving() || AcquireEngine()) ChangeState(states::IDENTIFYING_MESSAGE);
                 }
-                else if (available()) {
+                else if (BytesAvailable()) {
                     ESP_LOGE(TAG, "Data was received before beeing requested. If flow control via the RTS signal is not used, the minimum_period should be set to 0s in the yaml. Resetting.");
+                    BackOffPeriod("data before requested");
                     ChangeState(states::ERROR_RECOVERY);
+                    m_resynchronize = false; // It was not asked for
                 }
                 break;
             case states::ERROR_RECOVERY:
-                if (available()) {
+                if (BytesAvailable()) {
+                    // Look for the start of the next message among the bytes received. If
+                    // there is none, wait for the line to go quiet instead.
+                    // Only as often as a message may be requested
+                    bool const may_resynchronize{ m_resynchronize && PeriodElapsed(loop_start_time) };
                     int max_bytes_to_discard{ 200 };
-                    do { AddByteToDiscardLog(GetByte()); } while (available() && max_bytes_to_discard-- != 0);
+                    do {
+                        char const C{ GetByte() };
+                        bool const is_binary_start{ binary_format_supported && m_resynchronize_flag && (C & 0xf0) == 0xa0 };
+                        if (m_resynchronize_flag && !is_binary_start) {
+                            char const flag{ 0x7e };
+                            AddByteToDiscardLog(flag);
+                            if (m_secondary_p1) QueuePassthrough(&flag, 1);
+                        }
+                        m_resynchronize_flag = false;
+                        if (may_resynchronize && (is_binary_start || (ascii_format_supported && C == '/')) && (!HoldsEngineWhileReceiving() || AcquireEngine())) {
+                            ESP_LOGD(TAG, "Resynchronized after %d ms.", static_cast<int>(loop_start_time - m_error_recovery_time));
+                            FlushDiscardLog();
+                            ChangeState(states::IDENTIFYING_MESSAGE);
+                            if (is_binary_start) {
+                                IdentifyMessage(m_message, 0x7e);
+                                m_message.buffer[m_message.position++] = C;
+                                m_message.crc = crc16_x25(m_message.crc, C);
+                            }
+                            else IdentifyMessage(m_message, C);
+                            ChangeState(states::READING_MESSAGE);
+                            return;
+                        }
+                        if (may_resynchronize && binary_format_supported && C == 0x7e) {
+                            m_resynchronize_flag = true; // Decided by the next byte
+                            continue;
+                        }
+                        AddByteToDiscardLog(C);
+                        if (m_secondary_p1) QueuePassthrough(&C, 1);
+                    } while (BytesAvailable() && max_bytes_to_discard-- != 0);
                 }
                 else if (500 < loop_start_time - m_error_recovery_time) {
                     ChangeState(states::WAITING);
@@ -506,15 +742,172 @@ namespace esphome {
             }
         }
 
+        void P1Mini::register_text_sensor(IP1MiniTextSensor *sensor)
+        {
+            uint16_t node{ 0 };
+            for (char const *C{ sensor->Identifier() }; *C != '\0'; ++C) {
+                uint16_t child{ FindTextSensorTrieChild(node, *C) };
+                if (child == 0) {
+                    child = m_text_sensor_trie.size();
+                    P1MiniTextSensorTrieNode const new_node{ *C, 0, m_text_sensor_trie[node].first_child, nullptr };
+                    if (!m_text_sensor_trie.push_back(new_node)) {
+                        ESP_LOGE(TAG, "No room for text sensor with identifier '%s'.", sensor->Identifier());
+                        return;
+                    }
+                    m_text_sensor_trie[node].first_child = child;
+                }
+                node = child;
+            }
+            if (m_text_sensor_trie[node].sensor != nullptr) {
+                ESP_LOGW(TAG, "More than one text sensor with identifier '%s'. Only the first one will be used.", sensor->Identifier());
+                return;
+            }
+            m_text_sensor_trie[node].sensor = sensor;
+        }
+
+        IP1MiniTextSensor *P1Mini::FindTextSensor(char const *line) const
+        {
+            // Walk down the trie as long as the line matches, remembering the last (longest)
+            // identifier passed on the way.
+            IP1MiniTextSensor *match{ m_text_sensor_trie[0].sensor };
+            uint16_t node{ 0 };
+            for (char const *C{ line }; *C != '\0'; ++C) {
+                node = FindTextSensorTrieChild(node, *C);
+                if (node == 0) break;
+                if (m_text_sensor_trie[node].sensor != nullptr) match = m_text_sensor_trie[node].sensor;
+            }
+            return match;
+        }
+
+        void P1Mini::OnUnusedLine(char const *line, ObisLine const *obis_line)
+        {
+            IP1MiniTextSensor *const text_sensor{ FindTextSensor(line) };
+            if (text_sensor != nullptr) {
+                // Staged like the values. The line stays in the message buffer until it has been
+                // published, except when streaming, where it is copied to the text value storage.
+                int length{ static_cast<int>(std::strlen(line)) };
+                char const *value{ line };
+                if (m_streaming) {
+                    if (m_text_value_max_length < length) {
+                        ESP_LOGW(TAG, "Value of text sensor '%s' truncated to max_line_length (%d).", text_sensor->Identifier(), m_text_value_max_length);
+                        length = m_text_value_max_length;
+                    }
+                    if (m_text_value_storage_size - m_text_value_storage_used < length) {
+                        ESP_LOGW(TAG, "No room for the value of text sensor '%s'.", text_sensor->Identifier());
+                        return;
+                    }
+                    value = std::copy(line, line + length, m_text_value_storage + m_text_value_storage_used) - length;
+                    m_text_value_storage_used += length;
+                }
+                // A repeated identifier replaces the earlier value
+                auto iter{ std::find_if(m_staged_texts.begin(), m_staged_texts.end(), [=](P1MiniStagedText const &S) { return S.sensor == text_sensor; }) };
+                if (iter != m_staged_texts.end()) *iter = { text_sensor, value, length };
+                else m_staged_texts.push_back({ text_sensor, value, length });
+                return;
+            }
+            if (!m_log_unused_lines)
+                ESP_LOGV(TAG, "No sensor matched line '%s'", line);
+            else if (obis_line != nullptr)
+                ESP_LOGD(TAG, "No sensor matched line '%s' with obis code %d-%d:%d.%d.%d", line, obis_line->a_part, obis_line->b_part, obis_line->major, obis_line->minor, obis_line->micro);
+            else
+                ESP_LOGD(TAG, "No sensor matched line '%s'", line);
+        }
+
+        void P1Mini::ClearStagedValues()
+        {
+            for (int i{ 0 }; i < m_num_sensors; ++i) m_sensors[i].pending = false;
+            m_staged_texts.clear();
+            m_text_value_storage_used = 0;
+        }
+
+        uint64_t const *P1Mini::FindSensorObisCode(uint64_t obis) const
+        {
+            uint64_t const *const end{ m_sensor_obis_codes + m_num_sensors };
+            uint64_t const *iter{ std::lower_bound(m_sensor_obis_codes, end, obis) };
+            if (iter == end || *iter != obis) {
+                obis = OBIS_ANY(obis);
+                iter = std::lower_bound(iter, end, obis);
+                if (iter == end || *iter != obis) return nullptr;
+            }
+            return iter;
+        }
+
+        // Looked up before the value of the line is decoded, so that the lines nobody uses
+        // cost little more than their OBIS code
+        bool P1Mini::WantsValue(uint64_t obis) const
+        {
+            uint64_t const *iter{ FindSensorObisCode(obis) };
+            if (iter == nullptr) return false;
+#ifdef USE_P1_MINI_HISTORY
+            if (m_history_server != nullptr) return true; // Recorded whether published or not
+#endif
+            uint64_t const *const end{ m_sensor_obis_codes + m_num_sensors };
+            for (uint64_t const key{ *iter }; iter != end && *iter == key; ++iter) {
+                P1MiniSensorSlot const &slot{ m_sensors[iter - m_sensor_obis_codes] };
+                if (slot.sensor == nullptr || slot.required || slot.sensor->Enabled()) return true;
+            }
+            return false;
+        }
+
+        bool P1Mini::StageValue(uint64_t obis, P1MiniValue value)
+        {
+            uint64_t const *const end{ m_sensor_obis_codes + m_num_sensors };
+            uint64_t const *iter{ FindSensorObisCode(obis) };
+            if (iter == nullptr) return false;
+            obis = *iter;
+            // Several sensors may be configured with the same OBIS code
+            for (; iter != end && *iter == obis; ++iter) {
+                P1MiniSensorSlot &slot{ m_sensors[iter - m_sensor_obis_codes] };
+                slot.value = value;
+                slot.pending = true;
+            }
+            return true;
+        }
+
+        void P1Mini::ComputeDerivedValues(uint32_t current_time)
+        {
+            for (int i{ 0 }; i < m_num_derived_values; ++i) {
+                P1MiniDerivedValue &derived{ m_derived_values[i] };
+                // Only if all sources were in the message
+                if (!std::all_of(derived.sources, derived.sources + derived.num_sources, [this](int16_t source) { return m_sensors[source].pending; })) continue;
+                P1MiniValue const first{ m_sensors[derived.sources[0]].value };
+                P1MiniValue result{ first };
+                switch (derived.operation) {
+                case derived_operations::SUM:
+                    for (int j{ 1 }; j < derived.num_sources; ++j) result = result + m_sensors[derived.sources[j]].value;
+                    break;
+                case derived_operations::DIFFERENCE:
+                    for (int j{ 1 }; j < derived.num_sources; ++j) result = result - m_sensors[derived.sources[j]].value;
+                    break;
+                case derived_operations::INTEGRAL: {
+                    // Trapezoidal, over the time between the messages. Kept to six decimals.
+                    double const value{ first.ToDouble() };
+                    if (derived.has_previous) derived.integral += (derived.previous_value + value) / 2 * (current_time - derived.previous_time) / 3600000.0;
+                    derived.previous_value = value;
+                    derived.previous_time = current_time;
+                    derived.has_previous = true;
+                    result = P1MiniValue::FromDouble(derived.integral, -6);
+                    break;
+                }
+                }
+                P1MiniSensorSlot &slot{ m_sensors[derived.slot] };
+                slot.value = result;
+                slot.pending = true;
+            }
+        }
+
         void P1Mini::ChangeState(enum states new_state)
         {
             unsigned long const current_time{ millis() };
             switch (new_state) {
             case states::IDENTIFYING_MESSAGE:
+                DetachPassthrough();
+                m_message.crc_position = m_message.position = 0;
+                m_message.format = data_formats::UNKNOWN;
+                if (InSegmentedMessage()) break; // Receiving the next frame of the same message
+                if (m_streaming) ClearStagedValues();
                 m_identifying_message_time = current_time;
-                m_crc_position = m_message_buffer_position = 0;
-                m_num_message_loops = m_num_processing_loops = 0;
-                m_data_format = data_formats::UNKNOWN;
+                m_num_message_loops = m_num_processing_loops = m_num_publishing_loops = 0;
                 m_secondary_p1 = m_secondary_rts != nullptr && m_secondary_rts->state;
                 for (auto T : m_ready_to_receive_triggers) T->trigger();
                 break;
@@ -524,47 +917,133 @@ namespace esphome {
                 break;
             case states::VERIFYING_CRC:
                 m_verifying_crc_time = current_time;
-                for (auto T : m_update_received_triggers) T->trigger();
+                if (!IsSegment(m_message)) for (auto T : m_update_received_triggers) T->trigger();
                 break;
             case states::PROCESSING_ASCII:
             case states::PROCESSING_BINARY:
                 m_processing_time = current_time;
-                m_start_of_data = m_message_buffer;
+                if (binary_format_supported && new_state == states::PROCESSING_BINARY) Parser().StartBinary(m_message.buffer, m_message.buffer + m_message.crc_position);
+                else Parser().StartAscii(m_message.buffer + m_message.line_position);
+                if (m_next_message.buffer != nullptr) m_next_message_state = next_message_states::WAITING;
+                if (!m_streaming && !Parser().InSegmentedMessage()) ClearStagedValues();
+                break;
+            case states::PUBLISHING:
+                m_publishing_time = current_time;
+                m_publish_position = 0;
+                if (!m_shared_buffer) ReleaseEngine(); // The text values may point into the buffer
+                ComputeDerivedValues(current_time);
+#ifdef USE_P1_MINI_HISTORY
+                if (m_history_server != nullptr) {
+                    for (int i{ 0 }; i < m_num_sensors; ++i) {
+                        if (m_sensors[i].pending) m_history_server->Update(i, m_sensors[i].value);
+                    }
+                    m_history_server->Commit(current_time);
+                }
+#endif
                 break;
             case states::WAITING:
                 if (m_state != states::ERROR_RECOVERY) {
                     m_display_time_stats = true;
+                    ShortenPeriod();
                     for (auto T : m_update_processed_triggers) T->trigger();
+                    m_log_unused_lines = false;
                 }
                 m_waiting_time = current_time;
+                ReleaseEngine();
+                FlushDiscardLog(); // Whatever was held back by the rate limit
                 break;
             case states::ERROR_RECOVERY:
                 m_error_recovery_time = current_time;
+                m_resynchronize = true;
+                m_resynchronize_flag = false;
+                m_next_message_state = next_message_states::IDLE;
+                if (m_engine->Owns(this)) Parser().Reset();
+                ReleaseEngine();
+                DetachPassthrough();
                 for (auto T : m_communication_error_triggers) T->trigger();
             }
             m_state = new_state;
         }
 
+        void P1Mini::BackOffPeriod(char const *reason)
+        {
+            if (m_target_period_ms == 0) return;
+            m_num_good_updates = 0;
+            uint32_t const max_period_ms{ std::max<uint32_t>(8 * m_target_period_ms, 10000) };
+            if (m_period_ms == max_period_ms) return;
+            m_period_ms = std::min(m_period_ms + m_period_ms / 2, max_period_ms);
+            ESP_LOGW(TAG, "Period increased to %u ms after %s.", static_cast<unsigned>(m_period_ms), reason);
+        }
+
+        void P1Mini::ShortenPeriod()
+        {
+            if (m_target_period_ms == 0) return;
+            constexpr int good_updates_per_step{ 8 };
+            if (++m_num_good_updates < good_updates_per_step) return;
+            m_num_good_updates = 0;
+
+            // Asking more often than the meter can deliver gains nothing
+            float const delivery_time_ms{
+                m_time_stats[static_cast<int>(time_stages::IDENTIFYING)].Get(time_statistics::P95) +
+                m_time_stats[static_cast<int>(time_stages::MESSAGE)].Get(time_statistics::P95) };
+            uint32_t shortest_period_ms{ std::max(m_min_period_ms, m_target_period_ms) };
+            if (!std::isnan(delivery_time_ms)) shortest_period_ms = std::max(shortest_period_ms, static_cast<uint32_t>(delivery_time_ms));
+            // Move a quarter of the way towards the shortest period at a time
+            constexpr uint32_t min_step_ms{ 10 };
+            uint32_t period_ms{ shortest_period_ms };
+            if (shortest_period_ms < m_period_ms) {
+                uint32_t const step_ms{ (m_period_ms - shortest_period_ms) / 4 };
+                if (min_step_ms <= step_ms) period_ms = m_period_ms - step_ms;
+            }
+            if (period_ms == m_period_ms) return;
+            m_period_ms = period_ms;
+            ESP_LOGD(TAG, "Period changed to %u ms.", static_cast<unsigned>(m_period_ms));
+        }
+
         void P1Mini::AddByteToDiscardLog(uint8_t byte)
         {
+            ++m_num_discarded_bytes;
+            if (m_discard_log_position == m_discard_log_end) return;
             constexpr char hex_chars[] = "0123456789abcdef";
             *m_discard_log_position++ = hex_chars[byte >> 4];
             *m_discard_log_position++ = hex_chars[byte & 0xf];
-            if (m_discard_log_position == m_discard_log_end) FlushDiscardLog();
         }
 
         void P1Mini::FlushDiscardLog()
         {
-            if (m_discard_log_position != m_discard_log_buffer) {
-                *m_discard_log_position = '\0';
-                ESP_LOGW(TAG, "Discarding: %s", m_discard_log_buffer);
-                m_discard_log_position = m_discard_log_buffer;
-            }
+            // Logging is slow, so the discarded bytes are summarized, at most once per interval
+            constexpr unsigned long discard_log_interval_ms{ 10000 };
+            if (m_num_discarded_bytes == 0) return;
+            unsigned long const current_time{ millis() };
+            if (m_discard_log_time != 0 && current_time - m_discard_log_time < discard_log_interval_ms) return;
+            *m_discard_log_position = '\0';
+            ESP_LOGW(TAG, "Discarded %u bytes, starting with: %s", static_cast<unsigned>(m_num_discarded_bytes), m_discard_log_buffer);
+            m_discard_log_position = m_discard_log_buffer;
+            m_num_discarded_bytes = 0;
+            m_discard_log_time = current_time;
         }
 
 
         void P1Mini::dump_config() {
             ESP_LOGCONFIG(TAG, "P1 Mini component");
+            ESP_LOGCONFIG(TAG, "  Formats: %s", ascii_format_supported ? (binary_format_supported ? "ASCII, binary" : "ASCII") : "binary");
+            if (m_target_period_ms != 0) ESP_LOGCONFIG(TAG, "  Target period: %u ms (minimum %u ms)", static_cast<unsigned>(m_target_period_ms), static_cast<unsigned>(m_min_period_ms));
+            ESP_LOGCONFIG(TAG, "  Buffer: %d bytes%s", m_message.size, m_next_message.buffer != nullptr ? " (double)" : "");
+            ESP_LOGCONFIG(TAG, "  Processing budget: %u us per loop", static_cast<unsigned>(m_processing_budget_us));
+#ifdef USE_P1_MINI_RECEIVE_TASK
+            ESP_LOGCONFIG(TAG, "  Receive task: %s", m_receive_task != nullptr ? "yes" : "no");
+#endif
+#ifdef USE_P1_MINI_RAW_MQTT
+            if (!m_raw_mqtt_topic.empty()) ESP_LOGCONFIG(TAG, "  Raw telegrams to MQTT topic: %s", m_raw_mqtt_topic.c_str());
+#endif
+#ifdef USE_P1_MINI_RAW_UDP
+            if (m_raw_udp != nullptr) ESP_LOGCONFIG(TAG, "  Raw telegrams over UDP");
+#endif
+#ifdef USE_P1_MINI_TCP_SERVER
+            if (m_tcp_server != nullptr) ESP_LOGCONFIG(TAG, "  TCP server: port %u, up to %d clients", m_tcp_server->Port(), m_tcp_server->MaxClients());
+#endif
+            if (m_shared_buffer) ESP_LOGCONFIG(TAG, "  Buffer shared with other instances");
+            if (!HasSensors()) ESP_LOGCONFIG(TAG, "  No sensors, messages are not parsed");
         }
 
     }  // namespace p1_mini
@@ -3,9 +3,23 @@
 #include "esphome/core/component.h"
 #include "esphome/components/uart/uart.h"
 #include "esphome/components/binary_sensor/binary_sensor.h"
+#include "esphome/components/sensor/sensor.h"
 #include "esphome/core/automation.h"
+#include "p1_mini_engine.h"
+#include "p1_mini_parser.h"
+#include "p1_mini_history_server.h"
+#include "p1_mini_receive_task.h"
+#include "p1_mini_tcp_server.h"
+#ifdef USE_P1_MINI_RAW_MQTT
+#include "esphome/components/mqtt/mqtt_client.h"
+#endif
+#ifdef USE_P1_MINI_RAW_UDP
+#include "esphome/components/udp/udp_component.h"
+#endif
 
-#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
 
 namespace esphome {
     namespace p1_mini {
@@ -15,16 +29,22 @@ namespace esphome {
         {
         public:
             virtual ~IP1MiniSensor() = default;
-            virtual void publish_val(double) = 0;
-            virtual uint32_t Obis() const = 0;
+            virtual void publish_val(P1MiniValue) = 0;
+            virtual uint64_t Obis() const = 0;
+            virtual bool Enabled() const = 0;
         };
 
         class P1MiniSensorBase : public IP1MiniSensor
         {
-            uint32_t const m_obis;
+            uint64_t const m_obis;
+            bool m_enabled{ true };
         public:
-            P1MiniSensorBase(std::string obis_code);
-            virtual uint32_t Obis() const { return m_obis; }
+            P1MiniSensorBase(uint64_t obis);
+            virtual uint64_t Obis() const { return m_obis; }
+            // A disabled sensor is not published, and its value is not even decoded unless
+            // something else needs it. Can be changed at any time, e.g. from a lambda.
+            virtual bool Enabled() const { return m_enabled; }
+            void set_enabled(bool enabled) { m_enabled = enabled; }
         };
 
         class IP1MiniTextSensor
@@ -32,15 +52,143 @@ namespace esphome {
         public:
             virtual ~IP1MiniTextSensor() = default;
             virtual void publish_val(std::string) = 0;
-            virtual std::string Identifier() const = 0;
+            virtual char const *Identifier() const = 0;
         };
 
         class P1MiniTextSensorBase : public IP1MiniTextSensor
         {
-            std::string const m_identifier;
+            char const *const m_identifier; // Points to a string literal from the code generator
         public:
-            P1MiniTextSensorBase(std::string identifier);
-            virtual std::string Identifier() const { return m_identifier; }
+            P1MiniTextSensorBase(char const *identifier);
+            virtual char const *Identifier() const { return m_identifier; }
+        };
+
+        // One entry in the sensor table. Decoded values are staged here while the message is
+        // processed and published from the PUBLISHING state.
+        struct P1MiniSensorSlot {
+            IP1MiniSensor *sensor{ nullptr };
+            P1MiniValue value;
+            bool pending{ false };
+            bool required{ false }; // A source of a derived value, decoded even if the sensor is disabled
+        };
+
+        // Values computed from other values once per message, after it has been decoded. The
+        // sources and the result are slots in the sensor table.
+        enum class derived_operations {
+            SUM, // Of all sources
+            DIFFERENCE, // The first source minus the others
+            INTEGRAL // Of the first source over time, in hours (kW -> kWh)
+        };
+
+        struct P1MiniDerivedValue {
+            derived_operations operation;
+            int slot;
+            int16_t const *sources;
+            int num_sources;
+            // The state of the integration
+            double integral{ 0.0 };
+            double previous_value{ 0.0 };
+            uint32_t previous_time{ 0 };
+            bool has_previous{ false };
+        };
+
+        // A list in fixed size storage. The storage is provided by the code generator, sized
+        // from the configuration, so that nothing is allocated on the heap.
+        template<typename T>
+        class StaticList
+        {
+            T *m_items{ nullptr };
+            int m_capacity{ 0 };
+            int m_size{ 0 };
+        public:
+            void set_storage(T *items, int capacity)
+            {
+                m_items = items;
+                m_capacity = capacity;
+                m_size = 0;
+            }
+            bool push_back(T const &item)
+            {
+                if (m_size == m_capacity) return false;
+                m_items[m_size++] = item;
+                return true;
+            }
+            void clear() { m_size = 0; }
+            int size() const { return m_size; }
+            bool empty() const { return m_size == 0; }
+            T &operator[](int index) const { return m_items[index]; }
+            T *begin() const { return m_items; }
+            T *end() const { return m_items + m_size; }
+        };
+
+        // The text sensor identifiers are kept in a prefix trie, so that the longest matching
+        // identifier can be found in a single pass over the start of the line.
+        struct P1MiniTextSensorTrieNode {
+            char C{ '\0' };
+            uint16_t first_child{ 0 }; // 0 if none, as the root is never a child
+            uint16_t next_sibling{ 0 }; // 0 if none
+            IP1MiniTextSensor *sensor{ nullptr };
+        };
+
+        // A text sensor value, waiting to be published. Points into the message buffer, or into
+        // the text value storage when streaming. Not null terminated!
+        struct P1MiniStagedText {
+            IP1MiniTextSensor *sensor{ nullptr };
+            char const *value{ nullptr };
+            int length{ 0 };
+        };
+
+        // Diagnostics: the time spent in each stage of the update cycle, the number of loop()
+        // calls the processing took, and the number of errors
+        enum class time_stages {
+            IDENTIFYING,
+            MESSAGE,
+            PROCESSING,
+            PUBLISHING,
+            TOTAL,
+            PROCESSING_SLICES
+        };
+        constexpr static int num_time_stages{ 6 };
+
+        enum class time_statistics {
+            MIN,
+            AVG,
+            MAX,
+            P95
+        };
+
+        enum class error_counters {
+            CRC_ERRORS,
+            BUFFER_OVERRUNS,
+            TIMEOUTS,
+            UNKNOWN_FRAMES
+        };
+        constexpr static int num_error_counters{ 4 };
+
+        // Statistics over the most recent update cycles
+        class RollingStats
+        {
+            constexpr static int window_size{ 32 };
+            uint16_t m_samples[window_size];
+            int m_num_samples{ 0 };
+            int m_next_sample{ 0 };
+        public:
+            void Add(unsigned long value);
+            float Get(time_statistics statistic) const;
+        };
+
+        struct P1MiniTimeSensor {
+            time_stages stage;
+            time_statistics statistic;
+            sensor::Sensor *sensor;
+        };
+
+        // Where the message buffers are placed. PSRAM falls back to internal RAM if there is none
+        // to be had, and with STATIC the code generator reserves the buffers in .bss.
+        enum class buffer_locations {
+            INTERNAL,
+            PSRAM,
+            STATIC
         };
 
         class ReadyToReceiveTrigger : public Trigger<> { };
@@ -49,26 +197,54 @@ namespace esphome {
         class UpdateProcessedTrigger : public Trigger<> { };
         class CommunicationErrorTrigger : public Trigger<> { };
 
-        class P1Mini : public uart::UARTDevice, public Component {
+        class P1Mini : public uart::UARTDevice, public Component, private IP1MiniParserHandler {
         public:
-            P1Mini(uint32_t min_period_ms, int buffer_size);
+            P1Mini(uint32_t min_period_ms, int buffer_size, buffer_locations buffer_location = buffer_locations::INTERNAL);
 
             void setup() override;
             void loop() override;
             void dump_config() override;
 
-            void register_sensor(IP1MiniSensor *sensor)
+            // The sensors are kept in a table sorted by OBIS code. The code generator emits the sorted
+            // codes as a constant array and then registers every sensor in its slot in the table.
+            void set_sensor_table(uint64_t const *obis_codes, P1MiniSensorSlot *sensors, int num_sensors)
+            {
+                m_sensor_obis_codes = obis_codes;
+                m_sensors = sensors;
+                m_num_sensors = num_sensors;
+            }
+
+            void register_sensor(int slot, IP1MiniSensor *sensor) { m_sensors[slot].sensor = sensor; }
+            void set_derived_values(P1MiniDerivedValue *derived_values, int num_derived_values)
             {
-                m_sensors.emplace(sensor->Obis(), sensor);
+                m_derived_values = derived_values;
+                m_num_derived_values = num_derived_values;
             }
 
-            void register_text_sensor(IP1MiniTextSensor *sensor)
+            // Storage for the prefix trie of the text sensor identifiers (one node per character
+            // and a root), for the staged text values (one per text sensor) and, when streaming,
+            // for copies of the text values.
+            void set_text_sensor_storage(P1MiniTextSensorTrieNode *nodes, int num_nodes, P1MiniStagedText *staged_texts, int num_text_sensors)
             {
-                // Sort long identifiers first in the vector
-                auto iter{ m_text_sensors.begin() };
-                while (iter != m_text_sensors.end() && sensor->Identifier().size() < (*iter)->Identifier().size()) ++iter;
-                m_text_sensors.insert(iter, sensor);
+                m_text_sensor_trie.set_storage(nodes, num_nodes);
+                m_text_sensor_trie.push_back({});
+                m_staged_texts.set_storage(staged_texts, num_text_sensors);
             }
+            // Values longer than max_length are truncated, so that every text sensor has room
+            void set_text_value_storage(char *storage, int size, int max_length)
+            {
+                m_text_value_storage = storage;
+                m_text_value_storage_size = size;
+                m_text_value_max_length = max_length;
+            }
+
+            void register_text_sensor(IP1MiniTextSensor *sensor);
+
+            void set_ready_to_receive_trigger_storage(ReadyToReceiveTrigger **storage, int capacity) { m_ready_to_receive_triggers.set_storage(storage, capacity); }
+            void set_receiving_update_trigger_storage(ReceivingUpdateTrigger **storage, int capacity) { m_receiving_update_triggers.set_storage(storage, capacity); }
+            void set_update_received_trigger_storage(UpdateReceivedTrigger **storage, int capacity) { m_update_received_triggers.set_storage(storage, capacity); }
+            void set_update_processed_trigger_storage(UpdateProcessedTrigger **storage, int capacity) { m_update_processed_triggers.set_storage(storage, capacity); }
+            void set_communication_error_trigger_storage(CommunicationErrorTrigger **storage, int capacity) { m_communication_error_triggers.set_storage(storage, capacity); }
 
             void register_ready_to_receive_trigger(ReadyToReceiveTrigger *trigger) { m_ready_to_receive_triggers.push_back(trigger); }
             void register_receiving_update_trigger(ReceivingUpdateTrigger *trigger) { m_receiving_update_triggers.push_back(trigger); }
@@ -77,6 +253,46 @@ namespace esphome {
             void register_communication_error_trigger(CommunicationErrorTrigger *trigger) { m_communication_error_triggers.push_back(trigger); }
 
             void set_secondary_rts(binary_sensor::BinarySensor *sensor) { m_secondary_rts = sensor; }
+            void set_target_period(uint32_t target_period_ms)
+            {
+                m_target_period_ms = target_period_ms;
+                m_period_ms = std::max(m_min_period_ms, target_period_ms);
+            }
+            void set_diagnostics_interval(uint32_t interval_ms) { m_diagnostics_interval_ms = interval_ms; }
+            // The time the message is parsed for in each call to loop()
+            void set_processing_budget(uint32_t budget_us) { m_processing_budget_us = budget_us; }
+            void set_time_sensor_storage(P1MiniTimeSensor *storage, int capacity) { m_time_sensors.set_storage(storage, capacity); }
+            void add_time_sensor(time_stages stage, time_statistics statistic, sensor::Sensor *sensor) { m_time_sensors.push_back({ stage, statistic, sensor }); }
+            void set_error_sensor(error_counters counter, sensor::Sensor *sensor) { m_error_sensors[static_cast<int>(counter)] = sensor; }
+
+            void set_passthrough_uart(uart::UARTComponent *uart) { m_passthrough_uart = uart; }
+            // With buffer_locations::STATIC, each buffer must have room for buffer_size + 1 bytes.
+            // next_buffer is only used with double buffering.
+            void set_static_buffers(char *buffer, char *next_buffer);
+            void enable_double_buffering();
+            void enable_streaming() { m_streaming = true; }
+            // Every instance has an engine, which other instances can share. With shared_buffer,
+            // the instance receives into a buffer that is shared as well.
+            void set_engine(P1MiniEngine *engine, bool shared_buffer)
+            {
+                m_engine = engine;
+                m_shared_buffer = shared_buffer;
+            }
+#ifdef USE_P1_MINI_HISTORY
+            void set_history_server(P1MiniHistoryServer *history_server) { m_history_server = history_server; }
+#endif
+#ifdef USE_P1_MINI_RECEIVE_TASK
+            void set_receive_task(P1MiniReceiveTask *receive_task) { m_receive_task = receive_task; }
+#endif
+#ifdef USE_P1_MINI_TCP_SERVER
+            void set_tcp_server(P1MiniTcpServer *tcp_server) { m_tcp_server = tcp_server; }
+#endif
+#ifdef USE_P1_MINI_RAW_MQTT
+            void set_raw_mqtt_topic(std::string const &topic) { m_raw_mqtt_topic = topic; }
+#endif
+#ifdef USE_P1_MINI_RAW_UDP
+            void set_raw_udp(udp::UDPComponent *udp) { m_raw_udp = udp; }
+#endif
 
         private:
 
@@ -84,30 +300,88 @@ namespace esphome {
             unsigned long m_reading_message_time{ 0 };
             unsigned long m_verifying_crc_time{ 0 };
             unsigned long m_processing_time{ 0 };
+            unsigned long m_publishing_time{ 0 };
             unsigned long m_waiting_time{ 0 };
             unsigned long m_error_recovery_time{ 0 };
             int m_num_message_loops{ 0 };
             int m_num_processing_loops{ 0 };
+            int m_num_publishing_loops{ 0 };
+            uint32_t m_processing_budget_us{ 10000 };
             bool m_display_time_stats{ false };
             uint32_t m_time_stats_as_info_next{ 4 }; // 0 to disable
             uint32_t m_time_stats_counter{ 0 };
-            uint32_t m_obis_code{ 0 };
 
-            // Store the message as it is being received:
-            std::unique_ptr<char> m_message_buffer_UP;
-            int m_message_buffer_size;
-            char *m_message_buffer{ nullptr };
-            int m_message_buffer_position{ 0 };
-            int m_crc_position{ 0 };
+            RollingStats m_time_stats[num_time_stages];
+            uint32_t m_error_counts[num_error_counters]{};
+            StaticList<P1MiniTimeSensor> m_time_sensors;
+            sensor::Sensor *m_error_sensors[num_error_counters]{};
+            uint32_t m_diagnostics_interval_ms{ 60000 };
+
+            void CountError(error_counters counter) { ++m_error_counts[static_cast<int>(counter)]; }
+            void PublishDiagnostics();
+
+            // The parser is taken in turns with the other instances that share the engine.
+            // With a shared buffer, or when streaming, the engine is held from the start of
+            // the message, otherwise only while it is parsed.
+            P1MiniEngine *m_engine{ nullptr };
+            bool m_shared_buffer{ false };
+            P1MiniParser &Parser() const { return m_engine->Parser(); }
+            bool HoldsEngineWhileReceiving() const { return m_shared_buffer || m_streaming; }
+            bool AcquireEngine() { return m_engine->Acquire(this); }
+            void ReleaseEngine() { m_engine->Release(this); }
+            bool InSegmentedMessage() const { return m_engine->Owns(this) && Parser().InSegmentedMessage(); }
+
+#ifdef USE_P1_MINI_HISTORY
+            // Gets the values of every message, as they are published
+            P1MiniHistoryServer *m_history_server{ nullptr };
+#endif
+
+            // Every verified frame is sent on as it was received, before it is parsed
+#ifdef USE_P1_MINI_RAW_MQTT
+            std::string m_raw_mqtt_topic;
+#endif
+#ifdef USE_P1_MINI_RAW_UDP
+            udp::UDPComponent *m_raw_udp{ nullptr };
+#endif
+#ifdef USE_P1_MINI_TCP_SERVER
+            P1MiniTcpServer *m_tcp_server{ nullptr };
+#endif
+            void SendRawTelegram();
+            // Without any sensors, there is nothing to parse the message for
+            bool HasSensors() const { return m_num_sensors != 0 || m_text_sensor_trie.size() > 1; }
+
+            // The received data comes from the UART, or from the receive task if there is one
+#ifdef USE_P1_MINI_RECEIVE_TASK
+            P1MiniReceiveTask *m_receive_task{ nullptr };
+#endif
 
-            // Keeps track of the start of the data record while processing.
-            char *m_start_of_data;
+            int BytesAvailable()
+            {
+#ifdef USE_P1_MINI_RECEIVE_TASK
+                if (m_receive_task != nullptr) return m_receive_task->Available();
+#endif
+                return available();
+            }
 
             char GetByte()
             {
-                char const C{ static_cast<char>(read()) };
-                if (m_secondary_p1) write(C);
-                return C;
+#ifdef USE_P1_MINI_RECEIVE_TASK
+                char C{ '\0' };
+                if (m_receive_task != nullptr) return m_receive_task->Read(&C, 1) == 1 ? C : '\0';
+#endif
+                return static_cast<char>(read());
+            }
+
+            // Read all available data, but no more than max_bytes, in one go
+            int ReadBlock(char *destination, int max_bytes)
+            {
+#ifdef USE_P1_MINI_RECEIVE_TASK
+                if (m_receive_task != nullptr) return m_receive_task->Read(destination, max_bytes);
+#endif
+                int const num_bytes{ std::min(available(), max_bytes) };
+                if (num_bytes <= 0) return 0;
+                read_array(reinterpret_cast<uint8_t *>(destination), num_bytes);
+                return num_bytes;
             }
 
             enum class states {
@@ -116,6 +390,7 @@ namespace esphome {
                 VERIFYING_CRC,
                 PROCESSING_ASCII,
                 PROCESSING_BINARY,
+                PUBLISHING,
                 WAITING,
                 ERROR_RECOVERY
             };
@@ -123,30 +398,173 @@ namespace esphome {
 
             void ChangeState(enum states new_state);
 
+            // Stage the value for the sensors with a matching OBIS code, if there are any. The
+            // values are published later, from the PUBLISHING state.
+            bool StageValue(uint64_t obis, P1MiniValue value);
+            void ClearStagedValues();
+            // The first entry of the sensor table with the OBIS code, or with any A and B parts,
+            // or nullptr if there is none
+            uint64_t const *FindSensorObisCode(uint64_t obis) const;
+            // The unused lines are listed in the debug log for the first message only, as a
+            // guide to what the meter sends
+            bool m_log_unused_lines{ true };
+
+            // IP1MiniParserHandler
+            bool WantsValue(uint64_t obis) const override;
+            bool OnValue(uint64_t obis, P1MiniValue value) override { return StageValue(obis, value); }
+            void OnUnusedLine(char const *line, ObisLine const *obis_line) override;
+
             enum class data_formats {
                 UNKNOWN,
                 ASCII,
                 BINARY
             };
-            enum data_formats m_data_format { data_formats::UNKNOWN };
+
+            // Store the message as it is being received:
+            struct Message {
+                char *buffer{ nullptr };
+                int size{ 0 };
+                int position{ 0 };
+                int crc_position{ 0 };
+                int line_position{ 0 }; // Start of the line being received, when streaming
+                uint16_t crc{ 0 }; // Running CRC, updated as the message is received
+                enum data_formats format { data_formats::UNKNOWN };
+            };
+            // The buffers are allocated with malloc() (or heap_caps_malloc() for PSRAM)
+            struct BufferDeleter {
+                void operator()(char *buffer) const { std::free(buffer); }
+            };
+            using BufferOwner = std::unique_ptr<char[], BufferDeleter>;
+            char *m_static_next_buffer{ nullptr };
+            BufferOwner m_message_buffer_UP;
+            Message m_message;
+
+            // A binary frame with the segmentation bit set is followed by more frames of the
+            // same message
+            static bool IsSegment(Message const &message) { return message.format == data_formats::BINARY && (message.buffer[1] & 0x08) != 0; }
+
+            // With double buffering, the next message is received into a second buffer while
+            // m_message is being processed and published. The two are swapped when the processing
+            // is done.
+            enum class next_message_states {
+                IDLE,
+                WAITING,
+                IDENTIFYING,
+                READING,
+                COMPLETE,
+                FAILED
+            };
+            BufferOwner m_next_message_buffer_UP;
+            Message m_next_message;
+            enum next_message_states m_next_message_state { next_message_states::IDLE };
+            unsigned long m_next_identifying_message_time{ 0 };
+            unsigned long m_next_reading_message_time{ 0 };
+
+            bool AllocateBuffer(Message &message, BufferOwner &owner, int size);
+            void ReceiveNextMessage(unsigned long loop_start_time);
+            void TakeOverNextMessage();
+            void ContinueWithNextFrame();
+
+            enum class receive_results {
+                INCOMPLETE,
+                COMPLETE,
+                FAILED
+            };
+            // read_byte is the first byte of the message
+            receive_results IdentifyMessage(Message &message, char read_byte);
+            receive_results ReadMessage(Message &message);
+            static int MaxBytesToRead(Message const &message);
+
+            // In streaming mode, the lines of an ASCII message are handled while it is being
+            // received and then dropped from the buffer
+            bool m_streaming{ false };
+            void ParseStreamedLine(Message &message);
+            void CompactMessage(Message &message);
 
             uint32_t const m_min_period_ms;
+
+            // The time between requests. With a target period, it starts at the target, backs
+            // off when the meter fails to deliver and creeps back after a run of good updates,
+            // but never below what the meter has been measured to need (from the raised RTS to
+            // the end of the message).
+            uint32_t m_period_ms;
+            uint32_t m_target_period_ms{ 0 }; // 0 if not adaptive
+            int m_num_good_updates{ 0 };
+            void BackOffPeriod(char const *reason);
+            void ShortenPeriod();
+            buffer_locations const m_buffer_location;
             bool m_secondary_p1{ false };
+
+            // Passthrough to the secondary P1 port. The bytes of the message being received are
+            // forwarded straight from its buffer, no faster than the UART can send them so that
+            // writing never blocks. Bytes that have not been sent when the buffer is about to be
+            // reused, and bytes discarded during error recovery, are queued in a small ring buffer.
+            uart::UARTComponent *m_passthrough_uart{ nullptr };
+            Message const *m_passthrough_message{ nullptr };
+            int m_passthrough_position{ 0 };
+            unsigned long m_passthrough_time{ 0 };
+            constexpr static int passthrough_ring_size{ 256 };
+            constexpr static int passthrough_max_burst{ 128 }; // Size of the UART hardware FIFO
+            char m_passthrough_ring[passthrough_ring_size];
+            int m_passthrough_ring_start{ 0 };
+            int m_passthrough_ring_count{ 0 };
+            int m_passthrough_dropped{ 0 };
+
+            void StartPassthrough(Message const &message);
+            void QueuePassthrough(char const *data, int length);
+            void DetachPassthrough();
+            void SendPassthrough(unsigned long current_time);
             binary_sensor::BinarySensor *m_secondary_rts{ nullptr };
 
-            std::map<uint32_t, IP1MiniSensor *> m_sensors;
-            std::vector<IP1MiniTextSensor *> m_text_sensors; // Keep sorted so longer identifiers are first!
+            uint64_t const *m_sensor_obis_codes{ nullptr };
+            P1MiniSensorSlot *m_sensors{ nullptr };
+            int m_num_sensors{ 0 };
+            int m_publish_position{ 0 }; // Next slot to publish in the PUBLISHING state
+
+            P1MiniDerivedValue *m_derived_values{ nullptr };
+            int m_num_derived_values{ 0 };
+            void ComputeDerivedValues(uint32_t current_time);
+
+            P1MiniTextSensorTrieNode m_text_sensor_trie_root; // Used if there are no text sensors
+            StaticList<P1MiniTextSensorTrieNode> m_text_sensor_trie; // Node 0 is the root
+
+            uint16_t FindTextSensorTrieChild(uint16_t node, char C) const
+            {
+                uint16_t child{ m_text_sensor_trie[node].first_child };
+                while (child != 0 && m_text_sensor_trie[child].C != C) child = m_text_sensor_trie[child].next_sibling;
+                return child;
+            }
+
+            IP1MiniTextSensor *FindTextSensor(char const *line) const;
+
+            // The values for the text sensors are staged too, as they are found
+            StaticList<P1MiniStagedText> m_staged_texts;
+            char *m_text_value_storage{ nullptr };
+            int m_text_value_storage_size{ 0 };
+            int m_text_value_storage_used{ 0 };
+            int m_text_value_max_length{ 0 };
             
-            std::vector<ReadyToReceiveTrigger *> m_ready_to_receive_triggers;
-            std::vector<ReceivingUpdateTrigger *> m_receiving_update_triggers;
-            std::vector<UpdateReceivedTrigger *> m_update_received_triggers;
-            std::vector<UpdateProcessedTrigger *> m_update_processed_triggers;
-            std::vector<CommunicationErrorTrigger *> m_communication_error_triggers;
+            StaticList<ReadyToReceiveTrigger *> m_ready_to_receive_triggers;
+            StaticList<ReceivingUpdateTrigger *> m_receiving_update_triggers;
+            StaticList<UpdateReceivedTrigger *> m_update_received_triggers;
+            StaticList<UpdateProcessedTrigger *> m_update_processed_triggers;
+            StaticList<CommunicationErrorTrigger *> m_communication_error_triggers;
+
+            // After an error, reception resumes at the next start of a message, unless the
+            // data was not asked for
+            bool m_resynchronize{ true };
+            // The last byte discarded was an HDLC flag. It only starts a frame if the next byte
+            // is a frame format byte, as a 0x7e may just as well be part of the data.
+            bool m_resynchronize_flag{ false };
+            bool PeriodElapsed(unsigned long current_time) const { return m_period_ms == 0 || m_period_ms < current_time - m_identifying_message_time; }
 
+            // Only the first bytes discarded since the last summary are logged
             constexpr static int discard_log_num_bytes{ 32 };
             char m_discard_log_buffer[discard_log_num_bytes * 2 + 1];
             char *m_discard_log_position{ m_discard_log_buffer };
             char *const m_discard_log_end{ m_discard_log_buffer + (discard_log_num_bytes * 2) };
+            uint32_t m_num_discarded_bytes{ 0 };
+            unsigned long m_discard_log_time{ 0 };
 
             void AddByteToDiscardLog(uint8_t byte);
             void FlushDiscardLog();
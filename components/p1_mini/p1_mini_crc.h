@@ -0,0 +1,81 @@
+#pragma once
+
+// The CRCs of the two message formats. Like the parser, this part has no dependencies on
+// ESPHome, so that it can also be built and exercised on a host computer.
+
+#include <cstdint>
+
+#if defined(__has_include)
+#if __has_include("esphome/core/defines.h")
+#include "esphome/core/defines.h"
+#include "esphome/core/hal.h"
+#define P1_MINI_HAS_HAL
+#endif
+#endif
+
+namespace esphome {
+
+#ifndef P1_MINI_HAS_HAL
+#define PROGMEM
+    inline uint16_t progmem_read_uint16(uint16_t const *address) { return *address; }
+#endif
+
+    namespace p1_mini {
+
+        namespace {
+            // The CRCs are updated one byte at a time while the message is received, so that
+            // the message is already verified when the last byte has arrived.
+            //
+            // Both CRCs are reflected, so they can either be calculated bit by bit or with a
+            // 256 entry lookup table per polynomial. The tables are generated at compile time
+            // and placed in flash (PROGMEM on ESP8266). Which one is used is selected with the
+            // crc_method option in the yaml. Only the CRC of the supported formats is used, so
+            // the other table is never referenced and left out of the image.
+#ifdef USE_P1_MINI_CRC_TABLE
+            template<uint16_t Polynomial>
+            struct Crc16Table {
+                uint16_t values[256];
+                constexpr Crc16Table() : values{}
+                {
+                    for (int i = 0; i < 256; i++) {
+                        uint16_t wCrc = i;
+                        for (int j = 0; j < 8; j++)
+                            wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ Polynomial : wCrc >> 1;
+                        values[i] = wCrc;
+                    }
+                }
+            };
+
+            static const Crc16Table<0xA001> crc16_ccitt_false_table PROGMEM{};
+            static const Crc16Table<0x8408> crc16_x25_table PROGMEM{};
+
+            inline uint16_t crc16_ccitt_false(uint16_t wCrc, uint8_t byte) {
+                return (wCrc >> 8) ^ progmem_read_uint16(&crc16_ccitt_false_table.values[(wCrc ^ byte) & 0xff]);
+            }
+
+            inline uint16_t crc16_x25(uint16_t wCrc, uint8_t byte) {
+                return (wCrc >> 8) ^ progmem_read_uint16(&crc16_x25_table.values[(wCrc ^ byte) & 0xff]);
+            }
+#else
+            inline uint16_t crc16_ccitt_false(uint16_t wCrc, uint8_t byte) {
+                wCrc ^= byte;
+                for (int i = 0; i < 8; i++)
+                    wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ 0xA001 : wCrc >> 1;
+                return wCrc;
+            }
+
+            inline uint16_t crc16_x25(uint16_t wCrc, uint8_t byte) {
+                wCrc ^= byte;
+                for (int i = 0; i < 8; i++)
+                    wCrc = wCrc & 0x0001 ? (wCrc >> 1) ^ 0x8408 : wCrc >> 1;
+                return wCrc;
+            }
+#endif
+
+            constexpr static uint16_t crc16_ccitt_false_init{ 0x0000 };
+            constexpr static uint16_t crc16_x25_init{ 0xffff };
+            constexpr static uint16_t crc16_x25_final_xor{ 0xffff };
+        }
+
+    }  // namespace p1_mini
+}  // namespace esphome
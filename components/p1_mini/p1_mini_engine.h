@@ -0,0 +1,52 @@
+#pragma once
+
+// The parsing engine, which several instances can take turns with. Like the parser, this part
+// has no dependencies on ESPHome.
+
+#include "p1_mini_parser.h"
+
+namespace esphome {
+    namespace p1_mini {
+
+        // Holds the parser for one or more instances, each identified by its parser handler.
+        // Only the instance that has acquired the engine may use the parser, and the values it
+        // decodes go to that instance. When the engine is taken, the first instance to ask for
+        // it is next in line, so that the instances take turns.
+        class P1MiniEngine : private IP1MiniParserHandler
+        {
+        public:
+            P1MiniParser &Parser() { return m_parser; }
+
+            bool Acquire(IP1MiniParserHandler *instance)
+            {
+                if (m_owner == instance) return true;
+                if (m_owner == nullptr && (m_next == nullptr || m_next == instance)) {
+                    m_owner = instance;
+                    m_next = nullptr;
+                    return true;
+                }
+                if (m_next == nullptr) m_next = instance;
+                return false;
+            }
+
+            // Also gives up the instance's place in line
+            void Release(IP1MiniParserHandler const *instance)
+            {
+                if (m_owner == instance) m_owner = nullptr;
+                if (m_next == instance) m_next = nullptr;
+            }
+
+            bool Owns(IP1MiniParserHandler const *instance) const { return m_owner == instance; }
+
+        private:
+            P1MiniParser m_parser{ *this };
+            IP1MiniParserHandler *m_owner{ nullptr };
+            IP1MiniParserHandler const *m_next{ nullptr };
+
+            bool WantsValue(uint64_t obis) const override { return m_owner->WantsValue(obis); }
+            bool OnValue(uint64_t obis, P1MiniValue value) override { return m_owner->OnValue(obis, value); }
+            void OnUnusedLine(char const *line, ObisLine const *obis_line) override { m_owner->OnUnusedLine(line, obis_line); }
+        };
+
+    }  // namespace p1_mini
+}  // namespace esphome
@@ -0,0 +1,131 @@
+//-------------------------------------------------------------------------------------
+// ESPHome P1 Electricity Meter custom sensor
+//
+// A compact history of the sensor values. See p1_mini.cpp for history and license.
+//-------------------------------------------------------------------------------------
+
+#include "p1_mini_history.h"
+
+#include <algorithm>
+
+namespace esphome {
+    namespace p1_mini {
+
+        namespace {
+            uint64_t ZigZag(int64_t value)
+            {
+                return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+            }
+
+            int64_t UnZigZag(uint64_t value)
+            {
+                return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+            }
+
+            int VarintLength(uint64_t value)
+            {
+                int length{ 1 };
+                for (; value >= 0x80; value >>= 7) ++length;
+                return length;
+            }
+
+            void WriteLittleEndian(IP1MiniHistoryWriter &writer, uint64_t value, int num_bytes)
+            {
+                uint8_t bytes[8];
+                for (int i{ 0 }; i < num_bytes; ++i, value >>= 8) bytes[i] = static_cast<uint8_t>(value);
+                writer.Write(bytes, num_bytes);
+            }
+        }
+
+        void P1MiniHistory::SetStorage(uint64_t const *obis_codes, int num_values, int64_t *values, uint8_t *buffer, int buffer_size)
+        {
+            m_obis_codes = obis_codes;
+            m_num_values = num_values;
+            m_base = values;
+            m_last = values + num_values;
+            m_next = values + 2 * num_values;
+            std::fill(values, values + 3 * num_values, 0);
+            m_buffer = buffer;
+            m_buffer_size = buffer_size;
+            m_head = m_used = 0;
+            m_started = false;
+        }
+
+        void P1MiniHistory::Update(int index, P1MiniValue value)
+        {
+            if (index < 0 || m_num_values <= index) return;
+            m_next[index] = value.Rescaled(-3).mantissa;
+        }
+
+        bool P1MiniHistory::Commit(uint32_t time_ms)
+        {
+            if (!m_started) {
+                m_base_time_ms = m_last_time_ms = time_ms;
+                m_started = true;
+            }
+            uint32_t const time_delta{ time_ms - m_last_time_ms };
+            int length{ VarintLength(time_delta) };
+            for (int i{ 0 }; i < m_num_values; ++i) length += VarintLength(ZigZag(m_next[i] - m_last[i]));
+            if (m_buffer_size < length) {
+                std::copy(m_last, m_last + m_num_values, m_next);
+                return false;
+            }
+
+            while (m_buffer_size - m_used < length) DropOldest();
+            PutVarint(time_delta);
+            for (int i{ 0 }; i < m_num_values; ++i) {
+                PutVarint(ZigZag(m_next[i] - m_last[i]));
+                m_last[i] = m_next[i];
+            }
+            m_last_time_ms = time_ms;
+            return true;
+        }
+
+        void P1MiniHistory::Dump(IP1MiniHistoryWriter &writer, uint32_t current_time_ms) const
+        {
+            writer.Write(reinterpret_cast<uint8_t const *>("P1H1"), 4);
+            uint8_t const num_values{ static_cast<uint8_t>(m_num_values) };
+            writer.Write(&num_values, 1);
+            for (int i{ 0 }; i < m_num_values; ++i) WriteLittleEndian(writer, m_obis_codes[i], 8);
+            WriteLittleEndian(writer, current_time_ms, 4);
+            WriteLittleEndian(writer, m_base_time_ms, 4);
+            for (int i{ 0 }; i < m_num_values; ++i) WriteLittleEndian(writer, static_cast<uint64_t>(m_base[i]), 8);
+
+            // The samples may wrap around the end of the buffer
+            int const first_part{ std::min(m_used, m_buffer_size - m_head) };
+            writer.Write(m_buffer + m_head, first_part);
+            writer.Write(m_buffer, m_used - first_part);
+        }
+
+        void P1MiniHistory::Put(uint8_t byte)
+        {
+            m_buffer[(m_head + m_used++) % m_buffer_size] = byte;
+        }
+
+        void P1MiniHistory::PutVarint(uint64_t value)
+        {
+            for (; value >= 0x80; value >>= 7) Put(static_cast<uint8_t>(value | 0x80));
+            Put(static_cast<uint8_t>(value));
+        }
+
+        uint64_t P1MiniHistory::TakeVarint()
+        {
+            uint64_t value{ 0 };
+            for (int shift{ 0 }; m_used != 0; shift += 7) {
+                uint8_t const byte{ m_buffer[m_head] };
+                m_head = (m_head + 1) % m_buffer_size;
+                --m_used;
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) break;
+            }
+            return value;
+        }
+
+        void P1MiniHistory::DropOldest()
+        {
+            m_base_time_ms += static_cast<uint32_t>(TakeVarint());
+            for (int i{ 0 }; i < m_num_values; ++i) m_base[i] += UnZigZag(TakeVarint());
+        }
+
+    }  // namespace p1_mini
+}  // namespace esphome
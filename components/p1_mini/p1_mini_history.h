@@ -0,0 +1,67 @@
+#pragma once
+
+// A history of the sensor values of every message, kept compactly in a ring buffer. Like the
+// parser, this part has no dependencies on ESPHome.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "p1_mini_parser.h"
+
+namespace esphome {
+    namespace p1_mini {
+
+        // Receives the serialized history
+        class IP1MiniHistoryWriter
+        {
+        public:
+            virtual ~IP1MiniHistoryWriter() = default;
+            virtual void Write(uint8_t const *data, size_t length) = 0;
+        };
+
+        // Each sample is stored as the time since the previous sample, followed by the change
+        // of every value since the previous sample, as varints. The values are kept in
+        // thousandths, so an unchanged value takes one byte and a typical power reading two or
+        // three. When the buffer is full, the oldest samples are folded into the base values.
+        //
+        // Dump() writes, all little endian:
+        //   "P1H1", uint8 number of values, uint64 OBIS key of each value,
+        //   uint32 current time (ms), uint32 base time (ms), int64 base value of each value,
+        //   followed by the samples, oldest first: varint time delta (ms) and a zigzag varint
+        //   delta for each value.
+        class P1MiniHistory
+        {
+        public:
+            // values must have room for three times num_values
+            void SetStorage(uint64_t const *obis_codes, int num_values, int64_t *values, uint8_t *buffer, int buffer_size);
+
+            // Sets the value of the next sample. Values that are not set are unchanged.
+            void Update(int index, P1MiniValue value);
+            // Adds the sample. Returns false if it does not fit even in an empty buffer.
+            bool Commit(uint32_t time_ms);
+
+            void Dump(IP1MiniHistoryWriter &writer, uint32_t current_time_ms) const;
+
+        private:
+            uint64_t const *m_obis_codes{ nullptr };
+            int m_num_values{ 0 };
+            int64_t *m_base{ nullptr }; // The values before the oldest sample
+            int64_t *m_last{ nullptr }; // The values after the newest sample
+            int64_t *m_next{ nullptr }; // The values of the sample being prepared
+            uint32_t m_base_time_ms{ 0 };
+            uint32_t m_last_time_ms{ 0 };
+            bool m_started{ false };
+
+            uint8_t *m_buffer{ nullptr };
+            int m_buffer_size{ 0 };
+            int m_head{ 0 }; // The oldest sample
+            int m_used{ 0 };
+
+            void Put(uint8_t byte);
+            void PutVarint(uint64_t value);
+            uint64_t TakeVarint(); // From the head
+            void DropOldest();
+        };
+
+    }  // namespace p1_mini
+}  // namespace esphome
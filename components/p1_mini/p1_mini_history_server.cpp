@@ -0,0 +1,49 @@
+//-------------------------------------------------------------------------------------
+// ESPHome P1 Electricity Meter custom sensor
+//
+// Serves the history of the sensor values over HTTP. See p1_mini.cpp for history and
+// license.
+//-------------------------------------------------------------------------------------
+
+#include "p1_mini_history_server.h"
+
+#ifdef USE_P1_MINI_HISTORY
+
+#include "esphome/core/hal.h"
+
+namespace esphome {
+    namespace p1_mini {
+
+        namespace {
+            class ResponseWriter : public IP1MiniHistoryWriter
+            {
+                AsyncResponseStream &m_stream;
+            public:
+                explicit ResponseWriter(AsyncResponseStream &stream) : m_stream{ stream } { }
+                void Write(uint8_t const *data, size_t length) override
+                {
+                    for (size_t i{ 0 }; i < length; ++i) m_stream.write(data[i]);
+                }
+            };
+        }
+
+        bool P1MiniHistoryServer::canHandle(AsyncWebServerRequest *request) const
+        {
+            return request->method() == HTTP_GET && request->url() == m_path;
+        }
+
+        void P1MiniHistoryServer::handleRequest(AsyncWebServerRequest *request)
+        {
+            AsyncResponseStream *const stream{ request->beginResponseStream("application/octet-stream") };
+            {
+                ResponseWriter writer{ *stream };
+                LockGuard lock{ m_lock };
+                m_history.Dump(writer, millis());
+            }
+            request->send(stream);
+        }
+
+    }  // namespace p1_mini
+}  // namespace esphome
+
+#endif  // USE_P1_MINI_HISTORY
@@ -0,0 +1,49 @@
+#pragma once
+
+// Serves the history of the sensor values over HTTP. Selected with the history option in
+// the yaml.
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_P1_MINI_HISTORY
+
+#include "esphome/components/web_server_base/web_server_base.h"
+#include "esphome/core/helpers.h"
+#include "p1_mini_history.h"
+
+namespace esphome {
+    namespace p1_mini {
+
+        // The samples are added from loop(), while the requests are handled by the web server,
+        // possibly in another task, so all access to the history is serialized.
+        class P1MiniHistoryServer : public AsyncWebHandler
+        {
+        public:
+            explicit P1MiniHistoryServer(char const *path) : m_path{ path } { }
+
+            void SetStorage(uint64_t const *obis_codes, int num_values, int64_t *values, uint8_t *buffer, int buffer_size)
+            {
+                m_history.SetStorage(obis_codes, num_values, values, buffer, buffer_size);
+            }
+
+            // Only called from loop()
+            void Update(int index, P1MiniValue value) { m_history.Update(index, value); }
+            void Commit(uint32_t time_ms)
+            {
+                LockGuard lock{ m_lock };
+                m_history.Commit(time_ms);
+            }
+
+            bool canHandle(AsyncWebServerRequest *request) const override;
+            void handleRequest(AsyncWebServerRequest *request) override;
+
+        private:
+            char const *m_path;
+            P1MiniHistory m_history;
+            Mutex m_lock;
+        };
+
+    }  // namespace p1_mini
+}  // namespace esphome
+
+#endif  // USE_P1_MINI_HISTORY
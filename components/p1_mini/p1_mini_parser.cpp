@@ -0,0 +1,591 @@
+//-------------------------------------------------------------------------------------
+// ESPHome P1 Electricity Meter custom sensor
+//
+// Decoding of P1 messages, separated from the reception so that it does not depend on
+// ESPHome. See p1_mini.cpp for history and license.
+//-------------------------------------------------------------------------------------
+
+#include "p1_mini_parser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace esphome {
+    namespace p1_mini {
+
+        namespace {
+            constexpr int max_power_of_ten{ 18 };
+            constexpr int64_t powers_of_ten[max_power_of_ten + 1]{
+                1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL,
+                10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL, 100000000000000LL,
+                1000000000000000LL, 10000000000000000LL, 100000000000000000LL, 1000000000000000000LL
+            };
+
+            // Multiplying or dividing by a power of ten below these is exact
+            constexpr static double double_powers_of_ten[]{ 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+            constexpr int max_double_power{ 18 };
+
+            template<typename T, int max_power>
+            T Scale(T value, int exponent, T const (&powers)[max_power + 1])
+            {
+                for (; exponent < -max_power; exponent += max_power) value /= powers[max_power];
+                for (; exponent > max_power; exponent -= max_power) value *= powers[max_power];
+                return exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+            }
+        }
+
+        // Through double, which holds the mantissas of the energy registers exactly, where a
+        // float would already round the mantissa before it is scaled
+        float P1MiniValue::ToFloat() const
+        {
+            return static_cast<float>(ToDouble());
+        }
+
+        // A single division by an exact power of ten, so that the result is correctly rounded
+        // as long as the mantissa itself is exact
+        double P1MiniValue::ToDouble() const
+        {
+            return Scale<double, max_double_power>(static_cast<double>(mantissa), exponent, double_powers_of_ten);
+        }
+
+        P1MiniValue P1MiniValue::FromDouble(double value, int8_t exponent)
+        {
+            return { std::llround(Scale<double, max_double_power>(value, -exponent, double_powers_of_ten)), exponent };
+        }
+
+        P1MiniValue P1MiniValue::Rescaled(int8_t new_exponent) const
+        {
+            int const shift{ exponent - new_exponent };
+            if (shift >= 0) return { mantissa * powers_of_ten[std::min(shift, max_power_of_ten)], new_exponent };
+            // Rounded half away from zero
+            int64_t const divisor{ powers_of_ten[std::min(-shift, max_power_of_ten)] };
+            return { (mantissa < 0 ? mantissa - divisor / 2 : mantissa + divisor / 2) / divisor, new_exponent };
+        }
+
+        int P1MiniValue::Format(char *buffer) const
+        {
+            int const num_decimals{ std::max(0, -static_cast<int>(exponent)) };
+            if (num_decimals > max_power_of_ten || exponent > 8) {
+                // Not from a meter, but still a number
+                return snprintf(buffer, 32, "%g", ToDouble());
+            }
+            uint64_t magnitude{ mantissa < 0 ? 0 - static_cast<uint64_t>(mantissa) : static_cast<uint64_t>(mantissa) };
+            char digits[24];
+            int num_digits{ 0 };
+            do {
+                digits[num_digits++] = static_cast<char>('0' + magnitude % 10);
+                magnitude /= 10;
+            } while (magnitude != 0);
+            while (num_digits <= num_decimals) digits[num_digits++] = '0'; // As in 0.001
+
+            char *P{ buffer };
+            if (mantissa < 0) *P++ = '-';
+            for (int i{ num_digits - 1 }; i >= 0; --i) {
+                *P++ = digits[i];
+                if (i == num_decimals && i != 0) *P++ = '.';
+            }
+            for (int i{ 0 }; i < exponent; ++i) *P++ = '0';
+            *P = '\0';
+            return P - buffer;
+        }
+
+#ifdef USE_P1_MINI_ASCII
+        namespace {
+            inline bool IsDigit(char C) { return C >= '0' && C <= '9'; }
+
+            inline char const *ParseUnsigned(char const *C, uint32_t &value)
+            {
+                value = 0;
+                while (IsDigit(*C)) value = value * 10 + (*C++ - '0');
+                return C;
+            }
+
+            // Parse a decimal number such as "-0001.727" using integer maths only. Returns
+            // nullptr if there are no digits.
+            char const *ParseDecimal(char const *C, P1MiniValue &value)
+            {
+                constexpr int max_decimals{ 9 };
+                constexpr int64_t max_mantissa{ 100000000000000000LL };
+                bool const negative{ *C == '-' };
+                if (*C == '-' || *C == '+') ++C;
+                int64_t mantissa{ 0 };
+                int num_digits{ 0 };
+                int exponent{ 0 };
+                for (; IsDigit(*C); ++C, ++num_digits) {
+                    if (mantissa < max_mantissa) mantissa = mantissa * 10 + (*C - '0');
+                    else ++exponent;
+                }
+                if (*C == '.') {
+                    for (++C; IsDigit(*C); ++C, ++num_digits) {
+                        if (mantissa < max_mantissa && exponent > -max_decimals) {
+                            mantissa = mantissa * 10 + (*C - '0');
+                            --exponent;
+                        }
+                    }
+                }
+                if (num_digits == 0) return nullptr;
+                value = { negative ? -mantissa : mantissa, static_cast<int8_t>(exponent) };
+                return C;
+            }
+        }
+
+        char const *TokenizeObisCode(char const *line, ObisLine &result)
+        {
+            char const *C{ ParseUnsigned(line, result.major) };
+            if (C == line) return nullptr;
+            if (*C == '-') {
+                result.a_part = result.major;
+                char const *const b_start{ C + 1 };
+                C = ParseUnsigned(b_start, result.b_part);
+                if (C == b_start || *C++ != ':') return nullptr;
+                char const *const c_start{ C };
+                C = ParseUnsigned(c_start, result.major);
+                if (C == c_start) return nullptr;
+            }
+            if (*C++ != '.' || !IsDigit(*C)) return nullptr;
+            C = ParseUnsigned(C, result.minor);
+            if (*C++ != '.' || !IsDigit(*C)) return nullptr;
+            C = ParseUnsigned(C, result.micro);
+            return *C == '(' ? C : nullptr;
+        }
+
+        // The value is taken from the first group that holds a number, skipping groups that
+        // look like timestamps (e.g. "(210217184019W)").
+        void TokenizeObisValue(char const *C, ObisLine &result)
+        {
+            while (*C == '(' && !result.has_value) {
+                char const *const group_begin{ ++C };
+                int num_leading_digits{ 0 };
+                while (IsDigit(*C)) { ++C; ++num_leading_digits; }
+                while (*C != ')' && *C != '\0') ++C;
+                if (*C == '\0') break;
+                char const *const group_end{ C++ };
+                int const group_length = group_end - group_begin;
+
+                // Timestamps are long, and either all digits or all digits followed by W or S
+                bool const is_timestamp{ group_length > 10 &&
+                    (num_leading_digits == group_length ||
+                    (num_leading_digits == group_length - 1 && (group_end[-1] == 'W' || group_end[-1] == 'S'))) };
+                if (is_timestamp) continue;
+
+                P1MiniValue value;
+                char const *const number_end{ ParseDecimal(group_begin, value) };
+                if (number_end == nullptr || (number_end != group_end && *number_end != '*')) continue;
+
+                result.has_value = true;
+                result.value = value;
+                result.value_begin = group_begin;
+                result.value_length = number_end - group_begin;
+                if (*number_end == '*') {
+                    result.unit_begin = number_end + 1;
+                    result.unit_length = group_end - result.unit_begin;
+                }
+            }
+        }
+#endif
+
+        void P1MiniParser::StartAscii(char *buffer)
+        {
+            m_binary = false;
+            m_continued = false;
+            m_position = buffer;
+            m_scan_position = nullptr;
+            m_error = errors::NONE;
+        }
+
+        void P1MiniParser::StartBinary(char const *buffer, char const *end)
+        {
+            m_binary = true;
+            m_binary_begin = m_binary_position = reinterpret_cast<uint8_t const *>(buffer);
+            m_binary_end = reinterpret_cast<uint8_t const *>(end);
+            m_error = errors::NONE;
+        }
+
+        P1MiniParser::results P1MiniParser::ParseNext()
+        {
+#if defined(USE_P1_MINI_ASCII) && defined(USE_P1_MINI_BINARY)
+            return m_binary ? ParseBinaryElement() : ParseAsciiLine();
+#elif defined(USE_P1_MINI_ASCII)
+            return ParseAsciiLine();
+#else
+            return ParseBinaryElement();
+#endif
+        }
+
+#ifdef USE_P1_MINI_ASCII
+        P1MiniParser::results P1MiniParser::ParseAsciiLine()
+        {
+            if (m_scan_position == nullptr) {
+                while (*m_position == '\n' || *m_position == '\r') ++m_position;
+                m_scan_position = m_position;
+            }
+            char *end_of_line{ m_scan_position };
+            char const *const scan_end{ m_scan_position + max_scan_length };
+            while (*end_of_line != '\n' && *end_of_line != '\r' && *end_of_line != '\0' && *end_of_line != '!') {
+                if (++end_of_line == scan_end) {
+                    m_scan_position = end_of_line; // Continued in the next call
+                    return results::INCOMPLETE;
+                }
+            }
+            m_scan_position = nullptr;
+            char const end_of_line_char{ *end_of_line };
+            *end_of_line = '\0';
+
+            if (end_of_line != m_position) {
+                ObisLine obis_line;
+                char const *const groups{ TokenizeObisCode(m_position, obis_line) };
+                bool used{ false };
+                if (groups != nullptr) {
+                    // Most lines are of no interest, so their values are skipped
+                    uint64_t const obis{ OBIS(obis_line.a_part, obis_line.b_part, obis_line.major, obis_line.minor, obis_line.micro) };
+                    if (m_handler.WantsValue(obis)) {
+                        TokenizeObisValue(groups, obis_line);
+                        used = obis_line.has_value && m_handler.OnValue(obis, obis_line.value);
+                    }
+                }
+                if (!used) m_handler.OnUnusedLine(m_position, groups != nullptr ? &obis_line : nullptr);
+            }
+            *end_of_line = end_of_line_char;
+            if (end_of_line_char == '\0' || end_of_line_char == '!') return results::COMPLETE;
+            m_position = end_of_line + 1;
+            return results::INCOMPLETE;
+        }
+#endif
+
+#ifdef USE_P1_MINI_BINARY
+        namespace {
+            // How each COSEM data type (by tag) is laid out and decoded
+            enum class cosem_kinds : uint8_t {
+                UNKNOWN,
+                FIXED,      // size bytes that are skipped
+                CONTAINER,  // array or structure, followed by the number of elements
+                OCTETS,     // length prefixed string
+                BITS,       // length (in bits) prefixed bit string
+                SIGNED,     // size bytes, big endian
+                UNSIGNED,
+                FLOAT
+            };
+
+            struct CosemType {
+                cosem_kinds kind;
+                uint8_t size;
+            };
+
+            constexpr CosemType cosem_types[]{
+                { cosem_kinds::FIXED, 0 },      // 0x00 null-data
+                { cosem_kinds::CONTAINER, 0 },  // 0x01 array
+                { cosem_kinds::CONTAINER, 0 },  // 0x02 structure
+                { cosem_kinds::UNSIGNED, 1 },   // 0x03 boolean
+                { cosem_kinds::BITS, 0 },       // 0x04 bit-string
+                { cosem_kinds::SIGNED, 4 },     // 0x05 double-long
+                { cosem_kinds::UNSIGNED, 4 },   // 0x06 double-long-unsigned
+                { cosem_kinds::UNKNOWN, 0 },    // 0x07
+                { cosem_kinds::UNKNOWN, 0 },    // 0x08
+                { cosem_kinds::OCTETS, 0 },     // 0x09 octet-string
+                { cosem_kinds::OCTETS, 0 },     // 0x0a visible-string
+                { cosem_kinds::UNKNOWN, 0 },    // 0x0b
+                { cosem_kinds::OCTETS, 0 },     // 0x0c utf8-string
+                { cosem_kinds::FIXED, 1 },      // 0x0d bcd
+                { cosem_kinds::UNKNOWN, 0 },    // 0x0e
+                { cosem_kinds::SIGNED, 1 },     // 0x0f integer
+                { cosem_kinds::SIGNED, 2 },     // 0x10 long
+                { cosem_kinds::UNSIGNED, 1 },   // 0x11 unsigned
+                { cosem_kinds::UNSIGNED, 2 },   // 0x12 long-unsigned
+                { cosem_kinds::UNKNOWN, 0 },    // 0x13 compact-array
+                { cosem_kinds::SIGNED, 8 },     // 0x14 long64
+                { cosem_kinds::UNSIGNED, 8 },   // 0x15 long64-unsigned
+                { cosem_kinds::UNSIGNED, 1 },   // 0x16 enum
+                { cosem_kinds::FLOAT, 4 },      // 0x17 float32
+                { cosem_kinds::FLOAT, 8 },      // 0x18 float64
+                { cosem_kinds::FIXED, 12 },     // 0x19 date-time
+                { cosem_kinds::FIXED, 5 },      // 0x1a date
+                { cosem_kinds::FIXED, 4 },      // 0x1b time
+            };
+            constexpr int num_cosem_types{ sizeof(cosem_types) / sizeof(cosem_types[0]) };
+
+            constexpr uint8_t cosem_double_long_unsigned{ 0x06 };
+            constexpr uint8_t cosem_integer{ 0x0f };
+            constexpr uint8_t cosem_long{ 0x10 };
+            constexpr uint8_t cosem_long_unsigned{ 0x12 };
+            constexpr uint8_t cosem_enum{ 0x16 };
+            constexpr uint8_t apdu_data_notification{ 0x0f };
+
+            inline uint64_t ReadBigEndian(uint8_t const *P, int size)
+            {
+                uint64_t value{ 0 };
+                for (int i{ 0 }; i < size; ++i) value = value << 8 | P[i];
+                return value;
+            }
+
+            // Floating point values, which meters rarely use, are kept to six decimals
+            P1MiniValue DecodeNumber(cosem_kinds kind, uint8_t const *P, int size)
+            {
+                uint64_t const raw{ ReadBigEndian(P, size) };
+                if (kind == cosem_kinds::UNSIGNED) return { static_cast<int64_t>(raw), 0 };
+                if (kind == cosem_kinds::SIGNED) {
+                    int const shift{ 64 - size * 8 };
+                    return { static_cast<int64_t>(raw << shift) >> shift, 0 };
+                }
+                if (size == 4) {
+                    uint32_t const raw32{ static_cast<uint32_t>(raw) };
+                    float value;
+                    memcpy(&value, &raw32, sizeof(value));
+                    return P1MiniValue::FromDouble(value, -6);
+                }
+                double value;
+                memcpy(&value, &raw, sizeof(value));
+                return P1MiniValue::FromDouble(value, -6);
+            }
+
+            // The ASCII format reports power and energy in kW, kWh, kvar etc, while the scaler
+            // of a COSEM register gives W, Wh, var... Convert, so that both give the same values.
+            // Only the exponent changes, so no digits are lost.
+            P1MiniValue ScaleToAsciiUnit(P1MiniValue value, int8_t scaler, uint8_t unit)
+            {
+                if (unit >= 27 && unit <= 32) scaler -= 3; // W, VA, var, Wh, VAh, varh
+                value.exponent = static_cast<int8_t>(value.exponent + scaler);
+                return value;
+            }
+
+            // Registers without a scaler and unit, as in the flat lists of some meters, keep
+            // the fixed scaling they always had: thousandths (kW, kWh) for double-long-unsigned
+            // and tenths for long and long-unsigned.
+            P1MiniValue ScaleByType(P1MiniValue value, uint8_t tag)
+            {
+                if (tag == cosem_double_long_unsigned) value.exponent = static_cast<int8_t>(value.exponent - 3);
+                else if (tag == cosem_long || tag == cosem_long_unsigned) value.exponent = static_cast<int8_t>(value.exponent - 1);
+                return value;
+            }
+        }
+
+        // Skip the HDLC header. Returns false if the frame is too short.
+        bool P1MiniParser::SkipFrameHeader()
+        {
+            uint8_t const *&P{ m_binary_position };
+            P += 3; // Flag and frame format
+            while (P < m_binary_end && (*P & 1) == 0) ++P; // Destination address
+            ++P;
+            while (P < m_binary_end && (*P & 1) == 0) ++P; // Source address
+            P += 1 + 1 + 2; // Last byte of source address, control and header check sequence
+            return P <= m_binary_end;
+        }
+
+        // Skip the LLC bytes and the data-notification header, at the start of a message
+        bool P1MiniParser::SkipApduHeader()
+        {
+            uint8_t const *&P{ m_binary_position };
+            if (P + 3 <= m_binary_end && P[0] == 0xe6 && (P[1] == 0xe6 || P[1] == 0xe7)) P += 3;
+            if (P + 6 > m_binary_end) return false;
+            if (*P != apdu_data_notification) {
+                Fail(errors::UNSUPPORTED_APDU, *P);
+                return false;
+            }
+            P += 1 + 4;  // Tag and long-invoke-id-and-priority
+            if (*P == 0x09) ++P; // Some meters send the date-time as a tagged octet-string
+            P += 1 + *P;
+            return P <= m_binary_end;
+        }
+
+        // Lengths and element counts use the A-XDR encoding, where 0x81 and 0x82 mean that the
+        // length follows in one or two bytes. Returns 0 if the length continues beyond end and
+        // -1 if it is invalid.
+        int P1MiniParser::ReadLength(uint8_t const *&P, uint8_t const *end, uint32_t &length)
+        {
+            if (P >= end) return 0;
+            length = *P;
+            if (length < 0x80) {
+                ++P;
+                return 1;
+            }
+            int const num_bytes{ static_cast<int>(length & 0x7f) };
+            if (num_bytes > 2) return -1;
+            if (P + 1 + num_bytes > end) return 0;
+            length = ReadBigEndian(P + 1, num_bytes);
+            P += 1 + num_bytes;
+            return 1;
+        }
+
+        void P1MiniParser::FlushValue()
+        {
+            if (!m_has_value) return;
+            m_has_value = false;
+            m_handler.OnValue(m_obis_code, m_has_scaler_unit ? ScaleToAsciiUnit(m_value, m_scaler, m_unit) : ScaleByType(m_value, m_value_tag));
+        }
+
+        // The first number after the OBIS code, on the same level, is the value. An integer and
+        // an enum in a nested structure after that are the scaler and unit.
+        void P1MiniParser::OnBinaryNumber(uint8_t tag, P1MiniValue value)
+        {
+            if (m_obis_depth < 0) return;
+            if (!m_has_value) {
+                if (m_depth != m_obis_depth) return;
+                m_has_value = true;
+                m_value = value;
+                m_value_tag = tag;
+                m_has_scaler_unit = false;
+                m_scaler = 0;
+                m_unit = 0;
+            }
+            else if (m_depth > m_obis_depth) {
+                if (tag == cosem_integer) m_scaler = static_cast<int8_t>(value.mantissa);
+                else if (tag == cosem_enum) m_unit = static_cast<uint8_t>(value.mantissa);
+                else return;
+                m_has_scaler_unit = true;
+            }
+        }
+
+        // Count the element in its container and close the containers that are complete. The
+        // register ends when the container that held its OBIS code is closed.
+        void P1MiniParser::EndOfElement()
+        {
+            if (m_depth > 0) --m_remaining[m_depth - 1];
+            while (m_depth > 0 && m_remaining[m_depth - 1] == 0) {
+                if (--m_depth < m_obis_depth) {
+                    FlushValue();
+                    m_obis_depth = -1;
+                }
+            }
+        }
+
+        // Decodes the element at begin. Returns the number of bytes used, 0 if the element
+        // continues beyond end and has to be completed with data from the next frame, or -1 if
+        // decoding can not continue. Nothing is changed unless bytes are used. Strings and other
+        // elements that are only skipped may continue beyond end, which is handled by setting
+        // m_skip_remaining.
+        int P1MiniParser::DecodeElement(uint8_t const *const begin, uint8_t const *const end)
+        {
+            uint8_t const *P{ begin };
+            uint8_t const tag{ *P++ };
+            CosemType const type{ tag < num_cosem_types ? cosem_types[tag] : CosemType{ cosem_kinds::UNKNOWN, 0 } };
+            uint32_t length{ type.size };
+            switch (type.kind) {
+            case cosem_kinds::UNKNOWN:
+                // Without knowing its length, nothing after this element can be decoded
+                Fail(errors::UNSUPPORTED_DATA_TYPE, tag);
+                return -1;
+            case cosem_kinds::CONTAINER:
+                if (int const result{ ReadLength(P, end, length) }; result <= 0) {
+                    if (result < 0) Fail(errors::INVALID_DATA, tag);
+                    return result;
+                }
+                if (m_depth == max_depth) {
+                    Fail(errors::INVALID_DATA, tag);
+                    return -1;
+                }
+                if (m_depth > 0) --m_remaining[m_depth - 1];
+                m_remaining[m_depth++] = length + 1; // Counted down again by EndOfElement()
+                return P - begin;
+            case cosem_kinds::OCTETS:
+            case cosem_kinds::BITS:
+                if (int const result{ ReadLength(P, end, length) }; result <= 0) {
+                    if (result < 0) Fail(errors::INVALID_DATA, tag);
+                    return result;
+                }
+                if (type.kind == cosem_kinds::BITS) length = (length + 7) / 8;
+                if (tag == 0x09 && length == 6) {
+                    if (P + length > end) return 0;
+                    FlushValue();
+                    m_obis_code = OBIS(P[0], P[1], P[2], P[3], P[4]);
+                    m_obis_depth = m_depth;
+                }
+                break;
+            case cosem_kinds::SIGNED:
+            case cosem_kinds::UNSIGNED:
+            case cosem_kinds::FLOAT:
+                if (P + length > end) return 0;
+                OnBinaryNumber(tag, DecodeNumber(type.kind, P, length));
+                break;
+            case cosem_kinds::FIXED:
+                break;
+            }
+            if (P + length > end) {
+                m_skip_remaining = length - (end - P);
+                return end - begin;
+            }
+            return P + length - begin;
+        }
+
+        P1MiniParser::results P1MiniParser::EndOfFrame()
+        {
+            if (m_segmented) {
+                m_continued = true;
+                return results::NEXT_FRAME;
+            }
+            m_continued = false;
+            FlushValue();
+            return results::COMPLETE;
+        }
+
+        // A long message may be split over several frames, with the segmentation bit set in
+        // all but the last one. Each frame is decoded as it arrives. An element that is split
+        // between two frames is completed in m_carry, or skipped over if it is not needed.
+        P1MiniParser::results P1MiniParser::ParseBinaryElement()
+        {
+            uint8_t const *&P{ m_binary_position };
+            if (P == m_binary_begin) {
+                m_segmented = (m_binary_begin[1] & 0x08) != 0;
+                if (!m_continued) {
+                    m_depth = 0;
+                    m_obis_depth = -1;
+                    m_has_value = false;
+                    m_carry_length = 0;
+                    m_skip_remaining = 0;
+                }
+                if (!SkipFrameHeader() || (!m_continued && !SkipApduHeader())) {
+                    m_continued = false;
+                    return m_error == errors::NONE ? Fail(errors::INVALID_HEADER) : results::FAILED;
+                }
+                if (P >= m_binary_end) return EndOfFrame();
+            }
+
+            if (m_skip_remaining > 0) {
+                uint32_t const num_bytes{ std::min<uint32_t>(m_skip_remaining, m_binary_end - P) };
+                P += num_bytes;
+                m_skip_remaining -= num_bytes;
+                if (m_skip_remaining == 0) EndOfElement();
+                return P >= m_binary_end ? EndOfFrame() : results::INCOMPLETE;
+            }
+
+            int used;
+            if (m_carry_length > 0) {
+                int const num_new{ std::min<int>(carry_size - m_carry_length, m_binary_end - P) };
+                memcpy(m_carry + m_carry_length, P, num_new);
+                used = DecodeElement(m_carry, m_carry + m_carry_length + num_new);
+                if (used > 0) {
+                    used -= m_carry_length;
+                    m_carry_length = 0;
+                }
+                else if (used == 0) {
+                    m_carry_length += num_new;
+                    P += num_new;
+                    if (m_carry_length < carry_size) return EndOfFrame();
+                    // No element that is decoded is this long
+                    Fail(errors::INVALID_DATA, m_carry[0]);
+                    used = -1;
+                }
+            }
+            else {
+                used = DecodeElement(P, m_binary_end);
+                if (used == 0) {
+                    m_carry_length = m_binary_end - P;
+                    memcpy(m_carry, P, m_carry_length);
+                    P = m_binary_end;
+                    return EndOfFrame();
+                }
+            }
+            if (used < 0) {
+                m_continued = false;
+                if (m_error != errors::UNSUPPORTED_DATA_TYPE) return results::FAILED;
+                FlushValue();
+                return results::COMPLETE;
+            }
+            P += used;
+            if (m_skip_remaining == 0) EndOfElement();
+            return P >= m_binary_end ? EndOfFrame() : results::INCOMPLETE;
+        }
+#endif
+
+    }  // namespace p1_mini
+}  // namespace esphome
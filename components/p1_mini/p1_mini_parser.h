@@ -0,0 +1,220 @@
+#pragma once
+
+// Decoding of complete, CRC verified P1 messages. This part has no dependencies on ESPHome,
+// so that it can also be built and exercised on a host computer.
+
+#include <cstdint>
+
+#if defined(__has_include)
+#if __has_include("esphome/core/defines.h")
+#include "esphome/core/defines.h"
+#endif
+#endif
+
+// The message formats to support are selected with the format option in the yaml. Code for
+// a format that is not used by any instance is left out. Without either define (e.g. when
+// built on its own), both formats are supported.
+#if !defined(USE_P1_MINI_ASCII) && !defined(USE_P1_MINI_BINARY)
+#define USE_P1_MINI_ASCII
+#define USE_P1_MINI_BINARY
+#endif
+
+namespace esphome {
+    namespace p1_mini {
+
+#ifdef USE_P1_MINI_ASCII
+        constexpr static bool ascii_format_supported{ true };
+#else
+        constexpr static bool ascii_format_supported{ false };
+#endif
+#ifdef USE_P1_MINI_BINARY
+        constexpr static bool binary_format_supported{ true };
+#else
+        constexpr static bool binary_format_supported{ false };
+#endif
+
+        // Combine the five values of an OBIS code (A-B:C.D.E) into a single unsigned int for
+        // easier handling and comparison. The same packing is done by obis_key() in __init__.py.
+        inline uint64_t OBIS(uint32_t a_part, uint32_t b_part, uint32_t major, uint32_t minor, uint32_t micro)
+        {
+            return static_cast<uint64_t>(a_part & 0xff) << 32 | (b_part & 0xff) << 24 | (major & 0xff) << 16 | (minor & 0xff) << 8 | (micro & 0xff);
+        }
+
+        // Sensors configured with the simple format (C.D.E) match any A and B and have this
+        // bit set in the key instead.
+        constexpr static uint64_t OBIS_ANY_A_B{ 1ULL << 40 };
+
+        inline uint64_t OBIS_ANY(uint64_t obis)
+        {
+            return OBIS_ANY_A_B | (obis & 0xffffff);
+        }
+
+        // A decoded value as an integer and a power of ten, e.g. { 1727, -3 } for 1.727. The
+        // values are kept like this from decoding to publishing, so that they are converted to
+        // floating point only once and large energy registers keep all their digits.
+        struct P1MiniValue {
+            int64_t mantissa{ 0 };
+            int8_t exponent{ 0 };
+
+            // Rounded to the nearest float
+            float ToFloat() const;
+            double ToDouble() const;
+            static P1MiniValue FromDouble(double value, int8_t exponent);
+            // The same value with another exponent, rounded if that drops digits
+            P1MiniValue Rescaled(int8_t new_exponent) const;
+            // The exact decimal representation, e.g. "1.727". Needs room for 32 characters.
+            int Format(char *buffer) const;
+        };
+
+        inline P1MiniValue operator+(P1MiniValue a, P1MiniValue b)
+        {
+            int8_t const exponent{ a.exponent < b.exponent ? a.exponent : b.exponent };
+            return { a.Rescaled(exponent).mantissa + b.Rescaled(exponent).mantissa, exponent };
+        }
+
+        inline P1MiniValue operator-(P1MiniValue a, P1MiniValue b)
+        {
+            return a + P1MiniValue{ -b.mantissa, b.exponent };
+        }
+
+        // The result of tokenizing one line of an ASCII message
+        struct ObisLine {
+            uint32_t a_part{ 0 }, b_part{ 0 }, major{ 0 }, minor{ 0 }, micro{ 0 };
+            bool has_value{ false };
+            P1MiniValue value;
+            // The spans of the value and unit within the line, i.e. "0001.727" and "kW"
+            // for "1-0:1.7.0(0001.727*kW)". Not null terminated!
+            char const *value_begin{ nullptr };
+            int value_length{ 0 };
+            char const *unit_begin{ nullptr };
+            int unit_length{ 0 };
+        };
+
+#ifdef USE_P1_MINI_ASCII
+        // Tokenizes a line on the format "A-B:C.D.E(...)(...)" or "C.D.E(...)" in two steps, so
+        // that the value is only looked for if it is wanted. TokenizeObisCode() returns the
+        // first "(", or nullptr if the line does not start with an OBIS code.
+        char const *TokenizeObisCode(char const *line, ObisLine &result);
+        void TokenizeObisValue(char const *groups, ObisLine &result);
+#endif
+
+        // Receives the decoded contents of a message
+        class IP1MiniParserHandler
+        {
+        public:
+            virtual ~IP1MiniParserHandler() = default;
+            // Whether a value with the OBIS code would be used. The value of an ASCII line is not
+            // decoded otherwise.
+            virtual bool WantsValue(uint64_t obis) const = 0;
+            // A numeric value with an OBIS code. Returns true if the value was used.
+            virtual bool OnValue(uint64_t obis, P1MiniValue value) = 0;
+            // A (null terminated) line of an ASCII message that did not give a used value.
+            // obis_line is nullptr if the line does not start with an OBIS code.
+            virtual void OnUnusedLine(char const *line, ObisLine const *obis_line) = 0;
+        };
+
+        // Decodes a message one line (ASCII) or one data element (binary) at a time, so that
+        // the caller can spread the work over several calls to loop(). The position is kept
+        // between the calls, and a long line is searched for its end in steps, so that parsing
+        // can be suspended after any call to ParseNext().
+        class P1MiniParser
+        {
+        public:
+            enum class results {
+                INCOMPLETE,
+                COMPLETE,
+                NEXT_FRAME, // The frame is done, but the message continues in the next one
+                FAILED
+            };
+
+            enum class errors {
+                NONE,
+                INVALID_HEADER,
+                UNSUPPORTED_APDU,
+                INVALID_DATA,
+                UNSUPPORTED_DATA_TYPE // Not fatal, the values before it are still used
+            };
+
+            P1MiniParser(IP1MiniParserHandler &handler) : m_handler{ handler } { }
+
+            // The buffer holds the message from the leading '/' and must contain the
+            // terminating '!'. The lines are null terminated in place while they are handled,
+            // but the buffer is restored afterwards.
+            void StartAscii(char *buffer);
+
+            // The buffer holds the HDLC frame from the leading flag, and end is the position of
+            // the frame check sequence. The frame must carry a DLMS data-notification, or
+            // continue one if InSegmentedMessage().
+            void StartBinary(char const *buffer, char const *end);
+
+            results ParseNext();
+
+            // True between the frames of a segmented binary message
+            bool InSegmentedMessage() const { return m_continued; }
+            void Reset() { m_continued = false; }
+
+            errors Error() const { return m_error; }
+            uint8_t ErrorData() const { return m_error_data; }
+
+        private:
+            IP1MiniParserHandler &m_handler;
+            bool m_binary{ false };
+            // ASCII: the start of the current line and how far its end has been searched for,
+            // nullptr before the search starts
+            char *m_position{ nullptr };
+            char *m_scan_position{ nullptr };
+            constexpr static int max_scan_length{ 128 };
+            uint8_t const *m_binary_position{ nullptr };
+            uint8_t const *m_binary_begin{ nullptr };
+            uint8_t const *m_binary_end{ nullptr };
+
+            // The COSEM data is a tree of arrays and structures. The number of elements left in
+            // each open container is kept on a stack. A register is a structure holding the
+            // OBIS code, the value and, optionally, a structure with the scaler and unit. The
+            // value is held back until the structure ends, so that the scaler can be applied.
+            constexpr static int max_depth{ 8 };
+            uint16_t m_remaining[max_depth];
+            int m_depth{ 0 };
+            uint64_t m_obis_code{ 0 };
+            int m_obis_depth{ -1 }; // Depth at which m_obis_code was found, -1 if none
+            bool m_has_value{ false };
+            P1MiniValue m_value;
+            uint8_t m_value_tag{ 0 };
+            bool m_has_scaler_unit{ false };
+            int8_t m_scaler{ 0 };
+            uint8_t m_unit{ 0 };
+
+            // Segmentation
+            bool m_segmented{ false }; // The current frame is followed by more
+            bool m_continued{ false }; // The current frame continues the previous one
+            constexpr static int carry_size{ 16 };
+            uint8_t m_carry[carry_size];
+            int m_carry_length{ 0 };
+            uint32_t m_skip_remaining{ 0 };
+            errors m_error{ errors::NONE };
+            uint8_t m_error_data{ 0 };
+
+#ifdef USE_P1_MINI_ASCII
+            results ParseAsciiLine();
+#endif
+#ifdef USE_P1_MINI_BINARY
+            results ParseBinaryElement();
+            results EndOfFrame();
+            bool SkipFrameHeader();
+            bool SkipApduHeader();
+            static int ReadLength(uint8_t const *&P, uint8_t const *end, uint32_t &length);
+            int DecodeElement(uint8_t const *begin, uint8_t const *end);
+            void OnBinaryNumber(uint8_t tag, P1MiniValue value);
+            void EndOfElement();
+            void FlushValue();
+#endif
+            results Fail(errors error, uint8_t data = 0)
+            {
+                m_error = error;
+                m_error_data = data;
+                return results::FAILED;
+            }
+        };
+
+    }  // namespace p1_mini
+}  // namespace esphome
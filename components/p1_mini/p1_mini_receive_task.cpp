@@ -0,0 +1,48 @@
+//-------------------------------------------------------------------------------------
+// ESPHome P1 Electricity Meter custom sensor
+//
+// Reception of the UART data in a task of its own. See p1_mini.cpp for history and
+// license.
+//-------------------------------------------------------------------------------------
+
+#include "p1_mini_receive_task.h"
+
+#ifdef USE_P1_MINI_RECEIVE_TASK
+
+#include <algorithm>
+
+namespace esphome {
+    namespace p1_mini {
+
+        bool P1MiniReceiveTask::Start(uart_port_t uart_num)
+        {
+            m_uart_num = uart_num;
+            m_stream = xStreamBufferCreateStatic(sizeof m_stream_storage, 1, m_stream_storage, &m_stream_control);
+            if (m_stream == nullptr) return false;
+            m_task = xTaskCreateStatic(Run, "p1_mini_rx", stack_size, this, priority, m_stack, &m_task_control);
+            return m_task != nullptr;
+        }
+
+        void P1MiniReceiveTask::Run(void *arg)
+        {
+            P1MiniReceiveTask &self{ *static_cast<P1MiniReceiveTask *>(arg) };
+            uint8_t chunk[128];
+            while (true) {
+                // Sleep until the first byte arrives, then take whatever else is waiting
+                int num_bytes{ uart_read_bytes(self.m_uart_num, chunk, 1, portMAX_DELAY) };
+                if (num_bytes <= 0) continue;
+                size_t buffered{ 0 };
+                uart_get_buffered_data_len(self.m_uart_num, &buffered);
+                if (buffered != 0) {
+                    int const more{ uart_read_bytes(self.m_uart_num, chunk + 1, std::min(buffered, sizeof chunk - 1), 0) };
+                    if (0 < more) num_bytes += more;
+                }
+                size_t const sent{ xStreamBufferSend(self.m_stream, chunk, num_bytes, 0) };
+                if (sent < static_cast<size_t>(num_bytes)) self.m_dropped_bytes += num_bytes - sent;
+            }
+        }
+
+    }  // namespace p1_mini
+}  // namespace esphome
+
+#endif  // USE_P1_MINI_RECEIVE_TASK
@@ -0,0 +1,56 @@
+#pragma once
+
+// Reception of the UART data in a task of its own, on ESP32 with ESP-IDF. Selected with the
+// receive_task option in the yaml.
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_P1_MINI_RECEIVE_TASK
+
+#include <atomic>
+#include <cstdint>
+
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+
+namespace esphome {
+    namespace p1_mini {
+
+        // Moves the received bytes from the UART driver to a stream buffer. The task sleeps in
+        // the driver, which is woken by the receive interrupts, so that the UART's receive
+        // buffer is emptied even while loop() is held up by other components, and loop() only
+        // has to look at the stream buffer. Everything is statically allocated.
+        class P1MiniReceiveTask
+        {
+        public:
+            bool Start(uart_port_t uart_num);
+
+            int Available() const { return static_cast<int>(xStreamBufferBytesAvailable(m_stream)); }
+            int Read(char *destination, int max_bytes) { return static_cast<int>(xStreamBufferReceive(m_stream, destination, max_bytes, 0)); }
+
+            // The number of bytes lost because loop() did not keep up, since the last call
+            uint32_t TakeDroppedBytes() { return m_dropped_bytes.exchange(0); }
+
+        private:
+            constexpr static size_t buffer_size{ 2048 };
+            constexpr static uint32_t stack_size{ 2048 };
+            constexpr static UBaseType_t priority{ 5 };
+
+            uart_port_t m_uart_num{ UART_NUM_0 };
+            StreamBufferHandle_t m_stream{ nullptr };
+            StaticStreamBuffer_t m_stream_control;
+            uint8_t m_stream_storage[buffer_size + 1]; // A stream buffer holds one byte less than its storage
+            TaskHandle_t m_task{ nullptr };
+            StaticTask_t m_task_control;
+            StackType_t m_stack[stack_size];
+            std::atomic<uint32_t> m_dropped_bytes{ 0 };
+
+            static void Run(void *arg);
+        };
+
+    }  // namespace p1_mini
+}  // namespace esphome
+
+#endif  // USE_P1_MINI_RECEIVE_TASK
@@ -0,0 +1,145 @@
+//-------------------------------------------------------------------------------------
+// ESPHome P1 Electricity Meter custom sensor
+//
+// Serves the raw telegrams on a TCP port. See p1_mini.cpp for history and license.
+//-------------------------------------------------------------------------------------
+
+#include "p1_mini_tcp_server.h"
+
+#ifdef USE_P1_MINI_TCP_SERVER
+
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace esphome {
+    namespace p1_mini {
+
+        namespace {
+            constexpr char const *TAG{ "P1Mini" };
+
+            bool WouldBlock() { return errno == EWOULDBLOCK || errno == EAGAIN; }
+        }
+
+        bool P1MiniTcpServer::Start()
+        {
+            // Not done in setup(), as the network stack may not be up by then
+            m_listener = socket::socket_ip(SOCK_STREAM, 0);
+            if (!m_listener) {
+                ESP_LOGE(TAG, "Failed to create the TCP server socket (errno %d).", errno);
+                return false;
+            }
+            int const enable{ 1 };
+            m_listener->setsockopt(SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
+            m_listener->setblocking(false);
+
+            struct sockaddr_storage address;
+            socklen_t const address_length{ socket::set_sockaddr_any(reinterpret_cast<struct sockaddr *>(&address), sizeof address, m_port) };
+            if (address_length == 0 || m_listener->bind(reinterpret_cast<struct sockaddr *>(&address), address_length) != 0 || m_listener->listen(m_max_clients) != 0) {
+                ESP_LOGE(TAG, "Failed to listen on TCP port %u (errno %d).", m_port, errno);
+                m_listener.reset();
+                return false;
+            }
+            ESP_LOGI(TAG, "Serving the telegrams on TCP port %u.", m_port);
+            return true;
+        }
+
+        void P1MiniTcpServer::Loop()
+        {
+            if (!m_started) {
+                m_started = true;
+                Start();
+            }
+            if (!m_listener) return;
+
+            Accept();
+            for (int i{ 0 }; i < m_max_clients; ++i) {
+                P1MiniTcpClient &client{ m_clients[i] };
+                if (!client.socket) continue;
+
+                // Anything the client sends is ignored, but this is how a closed connection shows
+                uint8_t discard[32];
+                ssize_t const num_read{ client.socket->read(discard, sizeof discard) };
+                if (num_read == 0 || (num_read < 0 && !WouldBlock())) {
+                    ESP_LOGD(TAG, "TCP client disconnected.");
+                    Disconnect(client);
+                    continue;
+                }
+                Flush(client);
+            }
+        }
+
+        void P1MiniTcpServer::Accept()
+        {
+            while (true) {
+                struct sockaddr_storage address;
+                socklen_t address_length{ sizeof address };
+                std::unique_ptr<socket::Socket> socket{ m_listener->accept(reinterpret_cast<struct sockaddr *>(&address), &address_length) };
+                if (!socket) return;
+
+                P1MiniTcpClient *const end{ m_clients + m_max_clients };
+                P1MiniTcpClient *const client{ std::find_if(m_clients, end, [](P1MiniTcpClient const &C) { return !C.socket; }) };
+                if (client == end) {
+                    ESP_LOGW(TAG, "TCP client refused, there are already %d clients.", m_max_clients);
+                    continue; // Closed when the socket goes out of scope
+                }
+                socket->setblocking(false);
+                int const enable{ 1 };
+                socket->setsockopt(IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+                client->socket = std::move(socket);
+                client->position = m_length; // Starting with the next telegram
+                ESP_LOGD(TAG, "TCP client connected.");
+            }
+        }
+
+        void P1MiniTcpServer::Send(char const *data, int length)
+        {
+            if (m_buffer_size < length) {
+                ESP_LOGW(TAG, "Telegram of %d bytes does not fit in the TCP server buffer.", length);
+                return;
+            }
+            for (int i{ 0 }; i < m_max_clients; ++i) {
+                P1MiniTcpClient &client{ m_clients[i] };
+                if (client.socket && client.position != m_length) {
+                    ESP_LOGW(TAG, "TCP client disconnected, as it did not keep up.");
+                    Disconnect(client);
+                }
+            }
+            std::memcpy(m_buffer, data, length);
+            m_length = length;
+            for (int i{ 0 }; i < m_max_clients; ++i) {
+                P1MiniTcpClient &client{ m_clients[i] };
+                if (!client.socket) continue;
+                client.position = 0;
+                Flush(client);
+            }
+        }
+
+        void P1MiniTcpServer::Flush(P1MiniTcpClient &client)
+        {
+            while (client.socket && client.position != m_length) {
+                ssize_t const num_written{ client.socket->write(m_buffer + client.position, m_length - client.position) };
+                if (num_written < 0) {
+                    if (!WouldBlock()) {
+                        ESP_LOGD(TAG, "TCP client disconnected (errno %d).", errno);
+                        Disconnect(client);
+                    }
+                    return;
+                }
+                if (num_written == 0) return;
+                client.position += num_written;
+            }
+        }
+
+        void P1MiniTcpServer::Disconnect(P1MiniTcpClient &client)
+        {
+            client.socket->close();
+            client.socket.reset();
+        }
+
+    }  // namespace p1_mini
+}  // namespace esphome
+
+#endif  // USE_P1_MINI_TCP_SERVER
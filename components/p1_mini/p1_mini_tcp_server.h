@@ -0,0 +1,66 @@
+#pragma once
+
+// Serves the raw telegrams on a TCP port, like ser2net. Selected with the tcp_server option in
+// the yaml.
+
+#include "esphome/core/defines.h"
+
+#ifdef USE_P1_MINI_TCP_SERVER
+
+#include "esphome/components/socket/socket.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace esphome {
+    namespace p1_mini {
+
+        struct P1MiniTcpClient
+        {
+            std::unique_ptr<socket::Socket> socket;
+            int position{ 0 }; // How much of the telegram has been sent
+        };
+
+        // There is one copy of the telegram for all the clients, each with its own position in
+        // it. The sockets are non-blocking and are only written to from loop(). A client that
+        // has not taken all of a telegram by the time the next one arrives is disconnected.
+        class P1MiniTcpServer
+        {
+        public:
+            explicit P1MiniTcpServer(uint16_t port) : m_port{ port } { }
+
+            void SetStorage(P1MiniTcpClient *clients, int max_clients, char *buffer, int buffer_size)
+            {
+                m_clients = clients;
+                m_max_clients = max_clients;
+                m_buffer = buffer;
+                m_buffer_size = buffer_size;
+            }
+
+            // Accepts new clients and sends what is left of the telegram
+            void Loop();
+            void Send(char const *data, int length);
+
+            uint16_t Port() const { return m_port; }
+            int MaxClients() const { return m_max_clients; }
+
+        private:
+            uint16_t const m_port;
+            bool m_started{ false };
+            std::unique_ptr<socket::Socket> m_listener;
+            P1MiniTcpClient *m_clients{ nullptr };
+            int m_max_clients{ 0 };
+            char *m_buffer{ nullptr };
+            int m_buffer_size{ 0 };
+            int m_length{ 0 };
+
+            bool Start();
+            void Accept();
+            void Flush(P1MiniTcpClient &client);
+            void Disconnect(P1MiniTcpClient &client);
+        };
+
+    }  // namespace p1_mini
+}  // namespace esphome
+
+#endif  // USE_P1_MINI_TCP_SERVER
@@ -1,29 +1,75 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import sensor
-from esphome.const import CONF_FORMAT, CONF_ID, CONF_TIMEOUT
+from esphome.const import CONF_FORMAT, CONF_ID, CONF_TIMEOUT, CONF_TYPE
 
-from .. import CONF_P1_MINI_ID, CONF_OBIS_CODE, P1Mini, obis_code, p1_mini_ns
+from .. import (
+    CONF_DERIVED,
+    CONF_OBIS_CODE,
+    CONF_P1_MINI_ID,
+    CONF_SOURCES,
+    DERIVED_OPERATIONS,
+    OBIS_DERIVED,
+    P1Mini,
+    obis_code,
+    obis_key,
+    p1_mini_ns,
+    sensor_slot,
+)
 
 AUTO_LOAD = ["p1_mini"]
 
+CONF_DEADBAND = "deadband"
+CONF_MAX_INTERVAL = "max_interval"
+
 P1MiniSensor = p1_mini_ns.class_(
     "P1MiniSensor", sensor.Sensor, cg.Component)
 
-CONFIG_SCHEMA = sensor.sensor_schema(P1MiniSensor).extend(
-    {
-        cv.GenerateID(): cv.declare_id(P1MiniSensor),
-        cv.GenerateID(CONF_P1_MINI_ID): cv.use_id(P1Mini),
-        cv.Required(CONF_OBIS_CODE): cv.string
-    }
+def validate_derived(config):
+    num_sources = len(config[CONF_SOURCES])
+    if config[CONF_TYPE] == "difference" and num_sources < 2:
+        raise cv.Invalid("A difference needs at least two sources")
+    if config[CONF_TYPE] == "integral" and num_sources != 1:
+        raise cv.Invalid("An integral needs exactly one source")
+    return config
+
+# A value computed from the values of other OBIS codes in the same message
+DERIVED_SCHEMA = cv.All(
+    cv.Schema({
+        cv.Required(CONF_TYPE): cv.one_of(*DERIVED_OPERATIONS, lower=True),
+        cv.Required(CONF_SOURCES): cv.All(cv.ensure_list(obis_code), cv.Length(min=1, max=16)),
+    }),
+    validate_derived,
+)
+
+CONFIG_SCHEMA = cv.All(
+    sensor.sensor_schema(P1MiniSensor).extend(
+        {
+            cv.GenerateID(): cv.declare_id(P1MiniSensor),
+            cv.GenerateID(CONF_P1_MINI_ID): cv.use_id(P1Mini),
+            cv.Optional(CONF_OBIS_CODE): obis_code,
+            cv.Optional(CONF_DERIVED): DERIVED_SCHEMA,
+            cv.Optional(CONF_DEADBAND): cv.positive_float,
+            cv.Optional(CONF_MAX_INTERVAL): cv.positive_time_period_milliseconds,
+        }
+    ),
+    cv.has_exactly_one_key(CONF_OBIS_CODE, CONF_DERIVED),
 )
 
 async def to_code(config):
+    # Derived sensors have no OBIS code of their own
+    key = obis_key(config[CONF_OBIS_CODE]) if CONF_OBIS_CODE in config else OBIS_DERIVED
     var = cg.new_Pvariable(
         config[CONF_ID],
-        config[CONF_OBIS_CODE],
+        key,
     )
     await cg.register_component(var, config)
     await sensor.register_sensor(var, config)
+
+    # Only publish changed values if either option is given
+    if CONF_DEADBAND in config or CONF_MAX_INTERVAL in config:
+        cg.add(var.set_deadband(config.get(CONF_DEADBAND, 0.0)))
+    if CONF_MAX_INTERVAL in config:
+        cg.add(var.set_max_interval(config[CONF_MAX_INTERVAL].total_milliseconds))
     p1_mini = await cg.get_variable(config[CONF_P1_MINI_ID])
-    cg.add(p1_mini.register_sensor(var))
+    cg.add(p1_mini.register_sensor(sensor_slot(config[CONF_P1_MINI_ID], config[CONF_ID]), var))
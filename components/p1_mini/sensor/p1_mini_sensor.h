@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cmath>
 #include <string>
 
+#include "esphome/core/hal.h"
 #include "esphome/components/sensor/sensor.h"
 
 #include "../p1_mini.h"
@@ -13,11 +15,33 @@ namespace esphome
         class P1MiniSensor : public P1MiniSensorBase, public sensor::Sensor, public Component
         {
         public:
-            P1MiniSensor(std::string obis_code)
-                : P1MiniSensorBase{ obis_code }
+            P1MiniSensor(uint64_t obis)
+                : P1MiniSensorBase{ obis }
             {}
 
-            virtual void publish_val(double value) override { publish_state(value); }
+            // The only conversion to floating point of the value
+            virtual void publish_val(P1MiniValue decoded_value) override
+            {
+                float const value{ decoded_value.ToFloat() };
+                // Skip values within the deadband of the last published one, unless max_interval has passed
+                uint32_t const now{ millis() };
+                if (m_deadband >= 0 && m_has_published && std::fabs(value - m_last_published_value) <= m_deadband &&
+                    (m_max_interval_ms == 0 || now - m_last_publish_time < m_max_interval_ms)) return;
+                m_has_published = true;
+                m_last_published_value = value;
+                m_last_publish_time = now;
+                publish_state(value);
+            }
+
+            void set_deadband(float deadband) { m_deadband = deadband; }
+            void set_max_interval(uint32_t max_interval_ms) { m_max_interval_ms = max_interval_ms; }
+
+        private:
+            float m_deadband{ -1.0f }; // Negative to publish every value
+            uint32_t m_max_interval_ms{ 0 }; // 0 for no limit
+            bool m_has_published{ false };
+            float m_last_published_value{ 0.0f };
+            uint32_t m_last_publish_time{ 0 };
 
         };
 
@@ -3,22 +3,56 @@ import esphome.config_validation as cv
 from esphome.components import text_sensor
 from esphome.const import CONF_FORMAT, CONF_ID, CONF_TIMEOUT
 
-from .. import CONF_P1_MINI_ID, CONF_IDENTIFIER, P1Mini, identifier, p1_mini_ns
+from .. import (
+    CONF_IDENTIFIER,
+    CONF_OBIS_CODE,
+    CONF_P1_MINI_ID,
+    P1Mini,
+    identifier,
+    obis_code,
+    obis_key,
+    p1_mini_ns,
+    sensor_slot,
+)
 
 AUTO_LOAD = ["p1_mini"]
 
 P1MiniTextSensor = p1_mini_ns.class_(
     "P1MiniTextSensor", text_sensor.TextSensor, cg.Component)
+P1MiniValueTextSensor = p1_mini_ns.class_(
+    "P1MiniValueTextSensor", text_sensor.TextSensor, cg.Component)
+
+def text_sensor_schema(class_):
+    return text_sensor.text_sensor_schema(class_).extend(
+        {
+            cv.GenerateID(): cv.declare_id(class_),
+            cv.GenerateID(CONF_P1_MINI_ID): cv.use_id(P1Mini),
+        }
+    )
 
-CONFIG_SCHEMA = text_sensor.text_sensor_schema(P1MiniTextSensor).extend(
+# With an identifier, the text sensor gets the lines that start with it. With an OBIS code, it
+# gets the value in its exact decimal form.
+CONFIG_SCHEMA = cv.typed_schema(
     {
-        cv.GenerateID(): cv.declare_id(P1MiniTextSensor),
-        cv.GenerateID(CONF_P1_MINI_ID): cv.use_id(P1Mini),
-        cv.Required(CONF_IDENTIFIER): cv.string
-    }
+        "line": text_sensor_schema(P1MiniTextSensor).extend({ cv.Required(CONF_IDENTIFIER): cv.string }),
+        "value": text_sensor_schema(P1MiniValueTextSensor).extend({ cv.Required(CONF_OBIS_CODE): obis_code }),
+    },
+    key="type",
+    default_type="line",
 )
 
 async def to_code(config):
+    if CONF_OBIS_CODE in config:
+        var = cg.new_Pvariable(
+            config[CONF_ID],
+            obis_key(config[CONF_OBIS_CODE]),
+        )
+        await cg.register_component(var, config)
+        await text_sensor.register_text_sensor(var, config)
+        p1_mini = await cg.get_variable(config[CONF_P1_MINI_ID])
+        cg.add(p1_mini.register_sensor(sensor_slot(config[CONF_P1_MINI_ID], config[CONF_ID]), var))
+        return
+
     var = cg.new_Pvariable(
         config[CONF_ID],
         config[CONF_IDENTIFIER],
@@ -13,7 +13,7 @@ namespace esphome
         class P1MiniTextSensor : public P1MiniTextSensorBase, public text_sensor::TextSensor, public Component
         {
         public:
-            P1MiniTextSensor(std::string identifier)
+            P1MiniTextSensor(char const *identifier)
                 : P1MiniTextSensorBase{ identifier }
             {}
 
@@ -21,5 +21,23 @@ namespace esphome
 
         };
 
+        // Publishes the value of an OBIS code in its exact decimal form, e.g. for energy
+        // registers with more digits than a float holds
+        class P1MiniValueTextSensor : public P1MiniSensorBase, public text_sensor::TextSensor, public Component
+        {
+        public:
+            P1MiniValueTextSensor(uint64_t obis)
+                : P1MiniSensorBase{ obis }
+            {}
+
+            virtual void publish_val(P1MiniValue value) override
+            {
+                char text[32];
+                value.Format(text);
+                publish_state(text);
+            }
+
+        };
+
     } // namespace p1_mini
 } // namespace esphome
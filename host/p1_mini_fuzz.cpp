@@ -0,0 +1,86 @@
+// Fuzz target for the parser. The input is decoded both as an ASCII telegram and as a
+// sequence of HDLC frames, without verifying the CRC, so that any byte sequence reaches the
+// decoding. Each frame is copied to a buffer of its own size, so that reads beyond the frame
+// are caught by the address sanitizer.
+//
+// With libFuzzer (P1_MINI_FUZZ=ON, clang), this is the fuzz target. Otherwise a main() is
+// added that runs the files given on the command line through it, which is how the corpus
+// is replayed by the tests and how a crashing input is reproduced.
+
+#include "p1_mini_parser.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+using namespace esphome::p1_mini;
+
+namespace {
+    class NullHandler : public IP1MiniParserHandler
+    {
+    public:
+        bool WantsValue(uint64_t) const override { return true; }
+        bool OnValue(uint64_t, P1MiniValue value) override
+        {
+            char text[32];
+            value.Format(text);
+            value.ToFloat();
+            return true;
+        }
+        void OnUnusedLine(char const *, ObisLine const *) override { }
+    };
+
+    P1MiniParser::results Parse(P1MiniParser &parser)
+    {
+        P1MiniParser::results result;
+        do result = parser.ParseNext();
+        while (result == P1MiniParser::results::INCOMPLETE);
+        return result;
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size)
+{
+    NullHandler handler;
+    P1MiniParser parser{ handler };
+
+    // ASCII: the message buffer always holds the '!' that ended the message
+    std::vector<char> ascii(data, data + size);
+    ascii.push_back('!');
+    ascii.push_back('\0');
+    parser.StartAscii(ascii.data());
+    Parse(parser);
+
+    // Binary: the frame length is taken from the header, like while receiving. The frame
+    // check sequence and the closing flag follow the end given to the parser.
+    size_t position{ 0 };
+    while (position + 3 <= size) {
+        size_t const length{ static_cast<size_t>((0x07 & data[position + 1]) << 8 | data[position + 2]) };
+        if (length < 3 || position + length + 2 > size) break;
+        std::vector<char> frame(data + position, data + position + length + 2);
+        frame[0] = 0x7e;
+        parser.StartBinary(frame.data(), frame.data() + length - 1);
+        if (Parse(parser) != P1MiniParser::results::NEXT_FRAME) parser.Reset();
+        position += length + 2;
+    }
+    return 0;
+}
+
+#ifndef P1_MINI_LIBFUZZER
+int main(int argc, char *argv[])
+{
+    for (int i{ 1 }; i < argc; ++i) {
+        std::ifstream file(argv[i], std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "Could not read %s\n", argv[i]);
+            return 2;
+        }
+        std::vector<uint8_t> const data{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+}
+#endif
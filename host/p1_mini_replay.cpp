@@ -0,0 +1,320 @@
+// Replays captured P1 telegrams through the parser on a host computer. Each file holds one
+// message: an ASCII telegram from the '/' through the CRC, or the HDLC frames of a binary
+// message. The CRC of every telegram is verified and the values are decoded, as on the
+// device.
+//
+//   p1_mini_replay [--iterations N] [--dump] [--expect FILE] TELEGRAM...
+//
+// --dump prints the decoded values, and --expect compares them to a previous dump, so that
+// the replay works as a regression test. Unless the iterations are 0, the telegrams are then
+// replayed N times and the time and heap allocations per telegram are reported, followed by
+// the throughput of the CRC.
+
+#include "p1_mini_crc.h"
+#include "p1_mini_parser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+    // Counts the heap allocations, which the parser should not make at all
+    unsigned long g_allocations{ 0 };
+}
+
+void *operator new(std::size_t size)
+{
+    ++g_allocations;
+    if (void *p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+using namespace esphome::p1_mini;
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    // The positions of one frame (binary) or the whole message (ASCII) in the file, with
+    // crc_position as in the message buffer of the component
+    struct Frame {
+        int begin{ 0 };
+        int crc_position{ 0 };
+        int length{ 0 };
+    };
+
+    struct Telegram {
+        std::string name;
+        std::vector<char> buffer; // Null terminated, the ASCII parser needs that
+        bool binary{ false };
+        std::vector<Frame> frames;
+    };
+
+    // Collects the values of a message. The storage is reserved up front, so that only the
+    // allocations of the parser itself are counted.
+    class CollectingHandler : public IP1MiniParserHandler
+    {
+    public:
+        struct Value {
+            uint64_t obis;
+            P1MiniValue value;
+        };
+
+        CollectingHandler() { m_values.reserve(256); }
+
+        void Clear()
+        {
+            m_values.clear();
+            m_num_unused_lines = 0;
+        }
+
+        bool WantsValue(uint64_t) const override { return true; }
+
+        bool OnValue(uint64_t obis, P1MiniValue value) override
+        {
+            if (m_values.size() < m_values.capacity()) m_values.push_back({ obis, value });
+            return true;
+        }
+
+        void OnUnusedLine(char const *, ObisLine const *) override { ++m_num_unused_lines; }
+
+        std::vector<Value> const &Values() const { return m_values; }
+        int NumUnusedLines() const { return m_num_unused_lines; }
+
+    private:
+        std::vector<Value> m_values;
+        int m_num_unused_lines{ 0 };
+    };
+
+    bool ReadFile(char const *path, std::vector<char> &contents)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    // Finds the message or frames in the file. Returns an error message, or nullptr.
+    char const *SplitTelegram(Telegram &telegram)
+    {
+        std::vector<char> &buffer{ telegram.buffer };
+        int const size{ static_cast<int>(buffer.size()) };
+        int position{ 0 };
+        while (position < size && buffer[position] != '/' && buffer[position] != 0x7e) ++position;
+        if (position == size) return "No message found";
+
+        if (buffer[position] == '/') {
+            int const end{ static_cast<int>(std::find(buffer.begin() + position, buffer.end(), '!') - buffer.begin()) };
+            if (end + 5 > size) return "Incomplete message";
+            telegram.frames.push_back({ position, end + 1 - position, end + 5 - position });
+        }
+        else {
+            telegram.binary = true;
+            while (position + 3 <= size && buffer[position] == 0x7e) {
+                int const length{ (0x07 & buffer[position + 1]) << 8 | static_cast<uint8_t>(buffer[position + 2]) };
+                if (length < 3 || position + length + 2 > size) return "Incomplete frame";
+                telegram.frames.push_back({ position, length - 1, length + 2 });
+                // The closing flag may also open the next frame
+                position += length + 1;
+                if (position + 1 < size && buffer[position + 1] == 0x7e) ++position;
+            }
+        }
+        buffer.push_back('\0');
+        return nullptr;
+    }
+
+    bool VerifyCrc(Telegram const &telegram, Frame const &frame, uint16_t &crc, uint16_t &crc_from_msg)
+    {
+        char const *const message{ telegram.buffer.data() + frame.begin };
+        if (telegram.binary) {
+            crc = crc16_x25_init;
+            for (int i{ 1 }; i < frame.crc_position; ++i) crc = crc16_x25(crc, message[i]);
+            crc ^= crc16_x25_final_xor;
+            crc_from_msg = static_cast<uint8_t>(message[frame.crc_position + 1]) << 8 | static_cast<uint8_t>(message[frame.crc_position]);
+        }
+        else {
+            crc = crc16_ccitt_false_init;
+            for (int i{ 0 }; i < frame.crc_position; ++i) crc = crc16_ccitt_false(crc, message[i]);
+            char hex[5]{};
+            memcpy(hex, message + frame.crc_position, 4);
+            crc_from_msg = static_cast<uint16_t>(strtol(hex, nullptr, 16));
+        }
+        return crc == crc_from_msg;
+    }
+
+    char const *ErrorText(P1MiniParser::errors error)
+    {
+        switch (error) {
+        case P1MiniParser::errors::NONE: return "none";
+        case P1MiniParser::errors::INVALID_HEADER: return "invalid frame header";
+        case P1MiniParser::errors::UNSUPPORTED_APDU: return "unsupported APDU";
+        case P1MiniParser::errors::INVALID_DATA: return "invalid data";
+        case P1MiniParser::errors::UNSUPPORTED_DATA_TYPE: return "unsupported data type";
+        }
+        return "unknown";
+    }
+
+    // Verifies and decodes one message, like the component does from VERIFYING_CRC through
+    // PROCESSING_ASCII/BINARY. Writes what was found to out, if not nullptr.
+    void Replay(Telegram &telegram, P1MiniParser &parser, CollectingHandler &handler, std::ostream *out)
+    {
+        handler.Clear();
+        parser.Reset();
+        for (Frame const &frame : telegram.frames) {
+            uint16_t crc, crc_from_msg;
+            if (!VerifyCrc(telegram, frame, crc, crc_from_msg)) {
+                if (out != nullptr) {
+                    char text[64];
+                    snprintf(text, sizeof(text), "CRC mismatch, calculated %04X != %04X\n", crc, crc_from_msg);
+                    *out << text;
+                }
+                return;
+            }
+            char *const message{ telegram.buffer.data() + frame.begin };
+            if (telegram.binary) parser.StartBinary(message, message + frame.crc_position);
+            else parser.StartAscii(message);
+
+            P1MiniParser::results result;
+            do result = parser.ParseNext();
+            while (result == P1MiniParser::results::INCOMPLETE);
+
+            if (result == P1MiniParser::results::NEXT_FRAME) continue;
+            if (out == nullptr) return;
+            for (CollectingHandler::Value const &value : handler.Values()) {
+                char text[32];
+                value.value.Format(text);
+                *out << (value.obis >> 32 & 0xff) << '-' << (value.obis >> 24 & 0xff) << ':' << (value.obis >> 16 & 0xff) << '.'
+                     << (value.obis >> 8 & 0xff) << '.' << (value.obis & 0xff) << ' ' << text << '\n';
+            }
+            if (handler.NumUnusedLines() > 0) *out << "Unused lines: " << handler.NumUnusedLines() << '\n';
+            if (parser.Error() != P1MiniParser::errors::NONE) {
+                *out << (result == P1MiniParser::results::FAILED ? "Failed: " : "Stopped: ") << ErrorText(parser.Error())
+                     << " 0x" << std::hex << static_cast<int>(parser.ErrorData()) << std::dec << '\n';
+            }
+            return;
+        }
+        if (out != nullptr) *out << "Incomplete: the last frame is segmented\n";
+    }
+
+    void Benchmark(std::vector<Telegram> &telegrams, int iterations)
+    {
+        CollectingHandler handler;
+        P1MiniParser parser{ handler };
+        printf("%-32s %8s %6s %14s %12s\n", "telegram", "bytes", "frames", "ns/telegram", "allocations");
+        for (Telegram &telegram : telegrams) {
+            Replay(telegram, parser, handler, nullptr); // Warm up
+            unsigned long const allocations_before{ g_allocations };
+            clock::time_point const start{ clock::now() };
+            for (int i{ 0 }; i < iterations; ++i) Replay(telegram, parser, handler, nullptr);
+            double const ns{ std::chrono::duration<double, std::nano>(clock::now() - start).count() };
+            printf("%-32s %8zu %6zu %14.0f %12.2f\n", telegram.name.c_str(), telegram.buffer.size() - 1, telegram.frames.size(),
+                   ns / iterations, static_cast<double>(g_allocations - allocations_before) / iterations);
+        }
+
+        // The speed of the CRC matters, as it is updated for every byte that is received
+        std::vector<uint8_t> data(64 * 1024);
+        for (size_t i{ 0 }; i < data.size(); ++i) data[i] = static_cast<uint8_t>(i * 131 + 7);
+        int const rounds{ iterations < 16 ? 1 : iterations / 16 };
+        auto crc_throughput{ [&](uint16_t (*crc_function)(uint16_t, uint8_t), char const *name) {
+            uint16_t crc{ 0 };
+            clock::time_point const start{ clock::now() };
+            for (int round{ 0 }; round < rounds; ++round)
+                for (uint8_t byte : data) crc = crc_function(crc, byte);
+            double const seconds{ std::chrono::duration<double>(clock::now() - start).count() };
+            printf("%-32s %10.1f MB/s (%04X)\n", name, rounds * data.size() / seconds / 1e6, crc);
+        } };
+#ifdef USE_P1_MINI_CRC_TABLE
+        printf("CRC with lookup tables\n");
+#else
+        printf("CRC calculated bit by bit\n");
+#endif
+        crc_throughput(crc16_ccitt_false, "crc16_ccitt_false (ASCII)");
+        crc_throughput(crc16_x25, "crc16_x25 (binary)");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations{ 1000 };
+    bool dump{ false };
+    char const *expect{ nullptr };
+    std::vector<Telegram> telegrams;
+    for (int i{ 1 }; i < argc; ++i) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dump") == 0) dump = true;
+        else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc) expect = argv[++i];
+        else {
+            Telegram telegram;
+            char const *const base_name{ strrchr(argv[i], '/') };
+            telegram.name = base_name != nullptr ? base_name + 1 : argv[i];
+            if (!ReadFile(argv[i], telegram.buffer)) {
+                fprintf(stderr, "Could not read %s\n", argv[i]);
+                return 2;
+            }
+            if (char const *error = SplitTelegram(telegram)) {
+                fprintf(stderr, "%s: %s\n", argv[i], error);
+                return 2;
+            }
+            telegrams.push_back(std::move(telegram));
+        }
+    }
+    if (telegrams.empty()) {
+        fprintf(stderr, "Usage: %s [--iterations N] [--dump] [--expect FILE] TELEGRAM...\n", argv[0]);
+        return 2;
+    }
+
+    // In the same order however the shell expands the file names, so that dumps compare
+    std::sort(telegrams.begin(), telegrams.end(), [](Telegram const &a, Telegram const &b) { return a.name < b.name; });
+
+    int exit_code{ 0 };
+    if (dump || expect != nullptr) {
+        CollectingHandler handler;
+        P1MiniParser parser{ handler };
+        std::ostringstream out;
+        for (Telegram &telegram : telegrams) {
+            out << "# " << telegram.name << '\n';
+            Replay(telegram, parser, handler, &out);
+        }
+        if (dump) fputs(out.str().c_str(), stdout);
+        if (expect != nullptr) {
+            std::vector<char> expected;
+            if (!ReadFile(expect, expected)) {
+                fprintf(stderr, "Could not read %s\n", expect);
+                return 2;
+            }
+            std::string const actual{ out.str() };
+            if (actual != std::string(expected.begin(), expected.end())) {
+                // Point out the first line that differs
+                std::istringstream actual_lines{ actual }, expected_lines{ std::string(expected.begin(), expected.end()) };
+                std::string actual_line, expected_line;
+                for (int line{ 1 };; ++line) {
+                    bool const more_actual{ static_cast<bool>(std::getline(actual_lines, actual_line)) };
+                    bool const more_expected{ static_cast<bool>(std::getline(expected_lines, expected_line)) };
+                    if (!more_actual) actual_line = "(end)";
+                    if (!more_expected) expected_line = "(end)";
+                    if (actual_line != expected_line || (!more_actual && !more_expected)) {
+                        fprintf(stderr, "%s:%d: expected \"%s\", got \"%s\"\n", expect, line, expected_line.c_str(), actual_line.c_str());
+                        break;
+                    }
+                }
+                exit_code = 1;
+            }
+        }
+    }
+
+    if (iterations > 0) Benchmark(telegrams, iterations);
+    return exit_code;
+}
@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+# Writes the telegrams that are replayed by p1_mini_replay. They are synthesized from the
+# layouts that the meters are documented to send, with made up readings and serial numbers,
+# so that the corpus can be regenerated and extended without access to the meters.
+#
+#   python3 generate.py
+
+import struct
+from pathlib import Path
+
+HERE = Path(__file__).parent
+
+
+def crc16_ccitt_false(data):
+    # The reflected 0xA001 CRC of the ASCII format, like crc16_ccitt_false() in p1_mini_crc.h
+    crc = 0x0000
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def crc16_x25(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc ^ 0xFFFF
+
+
+def ascii_telegram(lines):
+    body = ("\r\n".join(lines) + "\r\n!").encode()
+    return body + ("%04X\r\n" % crc16_ccitt_false(body)).encode()
+
+
+# HDLC frame type 3 with the segmentation bit set in all but the last frame of a message
+def hdlc_frame(content, segmented=False, addresses=bytes([0x41, 0x08, 0x83]), control=0x13):
+    length = 2 + len(addresses) + 1 + 2 + len(content) + 2
+    header = bytes([0xA0 | (0x08 if segmented else 0) | (length >> 8 & 0x07), length & 0xFF]) + addresses + bytes([control])
+    frame = header + crc16_x25(header).to_bytes(2, "little") + content
+    return bytes([0x7E]) + frame + crc16_x25(frame).to_bytes(2, "little") + bytes([0x7E])
+
+
+LLC = bytes([0xE6, 0xE7, 0x00])
+
+
+def data_notification(payload, date_time=bytes(12)):
+    return bytes([0x0F, 0x40, 0x00, 0x00, 0x00, len(date_time)]) + date_time + payload
+
+
+def obis(a, b, c, d, e, f=255):
+    return bytes([0x09, 0x06, a, b, c, d, e, f])
+
+
+def octet_string(value):
+    return bytes([0x09, len(value)]) + value
+
+
+def visible_string(value):
+    return bytes([0x0A, len(value)]) + value
+
+
+def u32(value):
+    return bytes([0x06]) + value.to_bytes(4, "big")
+
+
+def u16(value):
+    return bytes([0x12]) + value.to_bytes(2, "big")
+
+
+def s16(value):
+    return bytes([0x10]) + value.to_bytes(2, "big", signed=True)
+
+
+def register(code, value, scaler, unit):
+    return bytes([0x02, 0x03]) + code + value + bytes([0x02, 0x02, 0x0F, scaler & 0xFF, 0x16, unit])
+
+
+def structure(*elements):
+    return bytes([0x02, len(elements)]) + b"".join(elements)
+
+
+def array(*elements):
+    return bytes([0x01, len(elements)]) + b"".join(elements)
+
+
+W, VAR, WH, VARH, A, V = 27, 29, 30, 32, 33, 35
+
+telegrams = {}
+
+telegrams["sagemcom_t211.txt"] = ascii_telegram([
+    "/FLU5\\253769484_A",
+    "",
+    "0-0:96.1.4(50217)",
+    "0-0:96.1.1(3153414733313031303231363035)",
+    "0-0:1.0.0(241014135409S)",
+    "1-0:1.8.1(004211.034*kWh)",
+    "1-0:1.8.2(003815.758*kWh)",
+    "1-0:2.8.1(000712.000*kWh)",
+    "1-0:2.8.2(000264.011*kWh)",
+    "0-0:96.14.0(0001)",
+    "1-0:1.4.0(02.351*kW)",
+    "1-0:1.6.0(241005094500S)(04.125*kW)",
+    "0-0:98.1.0(2)(1-0:1.6.0)(1-0:1.6.0)(240901000000S)(240812184500S)(03.918*kW)(241001000000S)(240923081500S)(04.481*kW)",
+    "1-0:1.7.0(01.463*kW)",
+    "1-0:2.7.0(00.000*kW)",
+    "1-0:21.7.0(00.412*kW)",
+    "1-0:41.7.0(00.508*kW)",
+    "1-0:61.7.0(00.543*kW)",
+    "1-0:22.7.0(00.000*kW)",
+    "1-0:42.7.0(00.000*kW)",
+    "1-0:62.7.0(00.000*kW)",
+    "1-0:32.7.0(234.7*V)",
+    "1-0:52.7.0(233.9*V)",
+    "1-0:72.7.0(235.2*V)",
+    "1-0:31.7.0(002.07*A)",
+    "1-0:51.7.0(002.44*A)",
+    "1-0:71.7.0(002.61*A)",
+    "0-0:96.3.10(1)",
+    "0-0:17.0.0(999.9*kW)",
+    "1-0:31.4.0(999*A)",
+    "0-0:96.13.0()",
+    "0-1:24.1.0(003)",
+    "0-1:96.1.1(37464C4F32313139303333373333)",
+    "0-1:24.4.0(1)",
+    "0-1:24.2.3(241014134558S)(01112.384*m3)",
+])
+
+telegrams["kaifa_ma105.txt"] = ascii_telegram([
+    "/KFM5KAIFA-METER",
+    "",
+    "1-3:0.2.8(42)",
+    "0-0:1.0.0(241014213128S)",
+    "0-0:96.1.1(4530303236303030303234343934333135)",
+    "1-0:1.8.1(003306.946*kWh)",
+    "1-0:1.8.2(002210.088*kWh)",
+    "1-0:2.8.1(000000.000*kWh)",
+    "1-0:2.8.2(000000.000*kWh)",
+    "0-0:96.14.0(0002)",
+    "1-0:1.7.0(02.793*kW)",
+    "1-0:2.7.0(00.000*kW)",
+    "0-0:96.7.21(00004)",
+    "0-0:96.7.9(00002)",
+    "1-0:99.97.0(2)(0-0:96.7.19)(221108071527W)(0000003456*s)(230720043011S)(0000000240*s)",
+    "1-0:32.32.0(00000)",
+    "1-0:32.36.0(00000)",
+    "0-0:96.13.1()",
+    "0-0:96.13.0()",
+    "1-0:31.7.0(012*A)",
+    "1-0:21.7.0(02.792*kW)",
+    "1-0:22.7.0(00.000*kW)",
+    "0-1:24.1.0(003)",
+    "0-1:96.1.0(4730303139333430323231313938343135)",
+    "0-1:24.2.1(241014210000S)(02671.790*m3)",
+])
+
+# The Kamstrup meters in the Netherlands and Sweden send the ASCII format with a few extra
+# registers, e.g. the reactive energy
+telegrams["kamstrup_omnipower.txt"] = ascii_telegram([
+    "/KAM5 OMNIPOWER",
+    "",
+    "0-0:1.0.0(241014101530W)",
+    "1-0:1.8.0(00021957.181*kWh)",
+    "1-0:2.8.0(00000009.542*kWh)",
+    "1-0:3.8.0(00000388.521*kvarh)",
+    "1-0:4.8.0(00004171.727*kvarh)",
+    "1-0:1.7.0(0003.642*kW)",
+    "1-0:2.7.0(0000.000*kW)",
+    "1-0:3.7.0(0000.000*kvar)",
+    "1-0:4.7.0(0000.318*kvar)",
+    "1-0:21.7.0(0001.176*kW)",
+    "1-0:41.7.0(0001.047*kW)",
+    "1-0:61.7.0(0001.419*kW)",
+    "1-0:22.7.0(0000.000*kW)",
+    "1-0:42.7.0(0000.000*kW)",
+    "1-0:62.7.0(0000.000*kW)",
+    "1-0:32.7.0(231.8*V)",
+    "1-0:52.7.0(232.6*V)",
+    "1-0:72.7.0(230.4*V)",
+    "1-0:31.7.0(005.1*A)",
+    "1-0:51.7.0(004.5*A)",
+    "1-0:71.7.0(006.2*A)",
+])
+
+# A message with a transmission error in the first line; the CRC does not match
+bad = bytearray(telegrams["kaifa_ma105.txt"])
+bad[bad.index(b"1-0:1.8.1") + 12] ^= 0x01
+telegrams["kaifa_ma105_bad_crc.txt"] = bytes(bad)
+
+# Aidon (Norway): registers are structures with the scaler and unit
+aidon = array(
+    structure(obis(1, 1, 0, 2, 129), visible_string(b"AIDON_V0001")),
+    structure(obis(0, 0, 96, 1, 0), visible_string(b"7359992899999999")),
+    structure(obis(0, 0, 96, 1, 7), visible_string(b"6525")),
+    register(obis(1, 0, 1, 7, 0), u32(1727), 0, W),
+    register(obis(1, 0, 2, 7, 0), u32(0), 0, W),
+    register(obis(1, 0, 3, 7, 0), u32(0), 0, VAR),
+    register(obis(1, 0, 4, 7, 0), u32(160), 0, VAR),
+    register(obis(1, 0, 31, 7, 0), s16(75), -1, A),
+    register(obis(1, 0, 51, 7, 0), s16(19), -1, A),
+    register(obis(1, 0, 71, 7, 0), s16(48), -1, A),
+    register(obis(1, 0, 32, 7, 0), u16(2318), -1, V),
+    register(obis(1, 0, 52, 7, 0), u16(2324), -1, V),
+    register(obis(1, 0, 72, 7, 0), u16(2331), -1, V),
+    structure(obis(0, 0, 1, 0, 0), octet_string(bytes([0x07, 0xE8, 0x0A, 0x0E, 0x01, 0x0D, 0x00, 0x00, 0xFF, 0x80, 0x00, 0x00]))),
+    register(obis(1, 0, 1, 8, 0), u32(667839), 1, WH),
+    register(obis(1, 0, 2, 8, 0), u32(0), 1, WH),
+    register(obis(1, 0, 3, 8, 0), u32(2198), 1, VARH),
+    register(obis(1, 0, 4, 8, 0), u32(102097), 1, VARH),
+)
+telegrams["aidon_6525.bin"] = hdlc_frame(LLC + data_notification(aidon))
+
+# Kamstrup (Norway, Denmark): a flat list of OBIS codes and values without scaler and unit,
+# which get the fixed scaling by data type
+kamstrup = structure(
+    visible_string(b"Kamstrup_V0001"),
+    obis(1, 1, 0, 0, 5), visible_string(b"5706567000000000"),
+    obis(1, 1, 96, 1, 1), visible_string(b"6841121BN243101040"),
+    obis(1, 1, 1, 7, 0), u32(1388),
+    obis(1, 1, 2, 7, 0), u32(0),
+    obis(1, 1, 3, 7, 0), u32(0),
+    obis(1, 1, 4, 7, 0), u32(214),
+    obis(1, 1, 31, 7, 0), u32(301),
+    obis(1, 1, 51, 7, 0), u32(127),
+    obis(1, 1, 71, 7, 0), u32(209),
+    obis(1, 1, 32, 7, 0), u16(228),
+    obis(1, 1, 52, 7, 0), u16(230),
+    obis(1, 1, 72, 7, 0), u16(229),
+)
+telegrams["kamstrup_omnipower.bin"] = hdlc_frame(LLC + data_notification(kamstrup, date_time=bytes([0x07, 0xE8, 0x0A, 0x0E, 0x01, 0x0D, 0x00, 0x00, 0xFF, 0x80, 0x00, 0x00])),
+                                                 addresses=bytes([0x2B, 0x21]))
+
+# A message split over three frames, with the cuts in the middle of OBIS codes and values
+content = LLC + data_notification(aidon)
+cuts = [0, 61, 140, len(content)]
+telegrams["aidon_6525_segmented.bin"] = b"".join(
+    hdlc_frame(content[begin:end], segmented=end < len(content)) for begin, end in zip(cuts, cuts[1:]))
+
+for name, data in telegrams.items():
+    (HERE / name).write_bytes(data)